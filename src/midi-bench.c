@@ -0,0 +1,283 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Benchmark of the MIDI paths of the JACK client, on synthetic buffers and
+ * sequences so that no daemon is needed.
+ *
+ *   midi-bench [events]
+ *
+ * runs every case for about the given number of events (default 2000000)
+ * and prints the time per event. */
+
+#include "pipewire-jack.c"
+
+#define BENCH_FRAMES		8192
+#define BENCH_BUFFER_SIZE	(256 * 1024)
+#define BENCH_MAX_INPUTS	256
+
+struct workload {
+	const char *name;
+	uint32_t size;		/* bytes per event */
+	uint32_t n_events;	/* events per cycle */
+};
+
+static const struct workload workloads[] = {
+	{ "controller-dense", 3, 1024 },
+	{ "sysex-heavy", 256, 64 },
+};
+
+static const uint32_t input_counts[] = { 1, 2, 4, 16, 64, 256 };
+
+static uint64_t total_events = 2000000;
+static volatile uint32_t sink;
+
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static void report(const char *what, const struct workload *w, uint32_t n_inputs,
+		uint64_t n_events, uint64_t nsec)
+{
+	char name[64];
+
+	if (n_inputs > 0)
+		snprintf(name, sizeof(name), "%s/%u", what, n_inputs);
+	else
+		snprintf(name, sizeof(name), "%s", what);
+
+	printf("%-20s %-18s %10"PRIu64" events %10.2f ns/event\n",
+			name, w->name, n_events,
+			n_events ? (double) nsec / n_events : 0.0);
+}
+
+static uint64_t n_cycles(uint32_t events_per_cycle)
+{
+	return SPA_MAX(total_events / SPA_MAX(events_per_cycle, 1u), 1u);
+}
+
+static void init_midi(void *data)
+{
+	struct midi_buffer *mb = data;
+
+	mb->magic = MIDI_BUFFER_MAGIC;
+	mb->buffer_size = BENCH_BUFFER_SIZE;
+	mb->nframes = BENCH_FRAMES;
+	mb->write_pos = 0;
+	mb->event_count = 0;
+	mb->lost_events = 0;
+}
+
+static void make_event(const struct workload *w, uint8_t *data, uint32_t i)
+{
+	if (w->size <= 3) {
+		data[0] = 0xb0 | (i & 0x0f);
+		data[1] = 0x07;
+		data[2] = i & 0x7f;
+	} else {
+		memset(data, i & 0x7f, w->size);
+		data[0] = 0xf0;
+		data[w->size - 1] = 0xf7;
+	}
+}
+
+static void fill_midi(const struct workload *w, void *midi, const uint8_t *data)
+{
+	uint32_t i;
+
+	jack_midi_clear_buffer(midi);
+	for (i = 0; i < w->n_events; i++)
+		jack_midi_event_write(midi, i * BENCH_FRAMES / w->n_events, data, w->size);
+}
+
+static void bench_write(const struct workload *w, void *midi, const uint8_t *data)
+{
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+	uint32_t j;
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		jack_midi_clear_buffer(midi);
+		for (j = 0; j < w->n_events; j++)
+			jack_midi_event_write(midi, j * BENCH_FRAMES / w->n_events, data, w->size);
+		n_events += jack_midi_get_event_count(midi);
+	}
+	report("write", w, 0, n_events, get_time_ns() - start);
+}
+
+static void bench_reserve(const struct workload *w, void *midi)
+{
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+	uint32_t j;
+	jack_midi_data_t *d;
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		jack_midi_clear_buffer(midi);
+		for (j = 0; j < w->n_events; j++) {
+			d = jack_midi_event_reserve(midi, j * BENCH_FRAMES / w->n_events, w->size);
+			if (d != NULL)
+				d[0] = 0xb0;
+		}
+		n_events += jack_midi_get_event_count(midi);
+	}
+	report("reserve", w, 0, n_events, get_time_ns() - start);
+}
+
+/* jack_midi_event_write() on an output port, straight into the sequence */
+static void bench_encode(const struct workload *w, void *midi, void *pod, const uint8_t *data)
+{
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+	uint32_t j;
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		midi_encode_init(midi, pod, BENCH_BUFFER_SIZE);
+		for (j = 0; j < w->n_events; j++)
+			jack_midi_event_write(midi, j * BENCH_FRAMES / w->n_events, data, w->size);
+		n_events += jack_midi_get_event_count(midi);
+	}
+	midi_encode_done(midi);
+	report("encode", w, 0, n_events, get_time_ns() - start);
+}
+
+static void bench_from_midi(const struct workload *w, void *midi, void *pod, const uint8_t *data)
+{
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+
+	fill_midi(w, midi, data);
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		convert_from_midi(midi, pod, BENCH_BUFFER_SIZE);
+		n_events += w->n_events;
+	}
+	report("from_midi", w, 0, n_events, get_time_ns() - start);
+}
+
+/* make n_inputs sequences that together hold the events of one cycle,
+ * interleaved in time */
+static void make_sequences(const struct workload *w, uint32_t n_inputs,
+		struct spa_pod_sequence **seq, void *pods, const uint8_t *data)
+{
+	uint32_t i, j, n_events = SPA_MAX(w->n_events / n_inputs, 1u);
+	uint32_t size = BENCH_BUFFER_SIZE / n_inputs;
+
+	for (i = 0; i < n_inputs; i++) {
+		struct spa_pod_builder b = { 0, };
+		struct spa_pod_frame f;
+		void *pod = SPA_MEMBER(pods, i * size, void);
+
+		spa_pod_builder_init(&b, pod, size);
+		spa_pod_builder_push_sequence(&b, &f, 0);
+		for (j = 0; j < n_events; j++) {
+			spa_pod_builder_control(&b,
+					(j * n_inputs + i) * BENCH_FRAMES / (n_events * n_inputs),
+					SPA_CONTROL_Midi);
+			spa_pod_builder_bytes(&b, data, w->size);
+		}
+		spa_pod_builder_pop(&b, &f);
+		seq[i] = pod;
+	}
+}
+
+static void bench_to_midi(const struct workload *w, uint32_t n_inputs, void *midi,
+		void *pods, const uint8_t *data)
+{
+	struct spa_pod_sequence *seq[BENCH_MAX_INPUTS];
+	struct midi_cursor heap[BENCH_MAX_INPUTS];
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+
+	make_sequences(w, n_inputs, seq, pods, data);
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		jack_midi_clear_buffer(midi);
+		convert_to_midi(seq, n_inputs, heap, midi);
+		n_events += jack_midi_get_event_count(midi);
+	}
+	report("to_midi", w, n_inputs, n_events, get_time_ns() - start);
+}
+
+/* a single input read through the view, like get_buffer_input_midi() */
+static void bench_view(const struct workload *w, void *midi, void *pods, const uint8_t *data)
+{
+	struct spa_pod_sequence *seq[1];
+	uint64_t i, start, n_events = 0, cycles = n_cycles(w->n_events);
+	uint32_t j, count;
+	jack_midi_event_t ev;
+
+	make_sequences(w, 1, seq, pods, data);
+
+	start = get_time_ns();
+	for (i = 0; i < cycles; i++) {
+		midi_view_init(midi, seq[0]);
+		count = jack_midi_get_event_count(midi);
+		for (j = 0; j < count; j++) {
+			jack_midi_event_get(&ev, midi, j);
+			sink += ev.buffer[0];
+		}
+		n_events += count;
+	}
+	jack_midi_clear_buffer(midi);
+	report("view", w, 1, n_events, get_time_ns() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	void *midi, *pod, *pods;
+	uint8_t data[256];
+	uint32_t i, j;
+
+	if (argc > 1 && (total_events = strtoull(argv[1], NULL, 10)) == 0) {
+		fprintf(stderr, "usage: %s [events]\n", argv[0]);
+		return 1;
+	}
+
+	midi = aligned_alloc(MAX_ALIGN, BENCH_BUFFER_SIZE);
+	pod = aligned_alloc(MAX_ALIGN, BENCH_BUFFER_SIZE);
+	pods = aligned_alloc(MAX_ALIGN, BENCH_BUFFER_SIZE);
+	if (midi == NULL || pod == NULL || pods == NULL) {
+		fprintf(stderr, "can't allocate buffers: %m\n");
+		return 1;
+	}
+	init_midi(midi);
+
+	for (i = 0; i < SPA_N_ELEMENTS(workloads); i++) {
+		const struct workload *w = &workloads[i];
+
+		make_event(w, data, i);
+
+		bench_write(w, midi, data);
+		bench_reserve(w, midi);
+		bench_encode(w, midi, pod, data);
+		bench_from_midi(w, midi, pod, data);
+		bench_view(w, midi, pods, data);
+		for (j = 0; j < SPA_N_ELEMENTS(input_counts); j++)
+			bench_to_midi(w, input_counts[j], midi, pods, data);
+	}
+
+	free(midi);
+	free(pod);
+	free(pods);
+
+	return 0;
+}
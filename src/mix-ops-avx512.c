@@ -0,0 +1,32 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <immintrin.h>
+
+#include "mix-ops.h"
+
+#define MIX_FUNC	mix_f32_avx512
+#define MIX_VEC		__m512
+#define MIX_WIDTH	16
+#define MIX_LOAD	_mm512_load_ps
+#define MIX_LOADU	_mm512_loadu_ps
+#define MIX_ADD		_mm512_add_ps
+#define MIX_STORE	_mm512_store_ps
+
+#include "mix-ops-simd.h"
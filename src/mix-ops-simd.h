@@ -0,0 +1,109 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* The mix kernel, included by each mix-ops-<isa>.c after defining:
+ *
+ *   MIX_FUNC   the name of the function
+ *   MIX_VEC    the vector type
+ *   MIX_WIDTH  the number of floats in a vector
+ *   MIX_LOAD, MIX_LOADU, MIX_ADD, MIX_STORE
+ *              aligned and unaligned load, add and aligned store
+ *
+ * There is no include guard, every file includes it once with its own
+ * definitions. */
+
+#define MIX_ALIGN	(MIX_WIDTH * sizeof(float))
+#define MIX_UNROLL	(4 * MIX_WIDTH)
+
+#define MIX_BLOCK(load)								\
+	for (; unrolled--; n += MIX_UNROLL) {					\
+		in[0] = load(&src[0][n + 0 * MIX_WIDTH]);			\
+		in[1] = load(&src[0][n + 1 * MIX_WIDTH]);			\
+		in[2] = load(&src[0][n + 2 * MIX_WIDTH]);			\
+		in[3] = load(&src[0][n + 3 * MIX_WIDTH]);			\
+		for (i = 1; i < n_src; i++) {					\
+			in[0] = MIX_ADD(in[0], load(&src[i][n + 0 * MIX_WIDTH]));	\
+			in[1] = MIX_ADD(in[1], load(&src[i][n + 1 * MIX_WIDTH]));	\
+			in[2] = MIX_ADD(in[2], load(&src[i][n + 2 * MIX_WIDTH]));	\
+			in[3] = MIX_ADD(in[3], load(&src[i][n + 3 * MIX_WIDTH]));	\
+		}								\
+		MIX_STORE(&dst[n + 0 * MIX_WIDTH], in[0]);			\
+		MIX_STORE(&dst[n + 1 * MIX_WIDTH], in[1]);			\
+		MIX_STORE(&dst[n + 2 * MIX_WIDTH], in[2]);			\
+		MIX_STORE(&dst[n + 3 * MIX_WIDTH], in[3]);			\
+	}									\
+	for (; remain--; n += MIX_WIDTH) {					\
+		in[0] = load(&src[0][n]);					\
+		for (i = 1; i < n_src; i++)					\
+			in[0] = MIX_ADD(in[0], load(&src[i][n]));		\
+		MIX_STORE(&dst[n], in[0]);					\
+	}
+
+/* Scalar head until dst is aligned, then a vector body with aligned
+ * stores. The inputs are read with aligned loads when they all share the
+ * alignment of dst and with unaligned loads otherwise, so a misaligned
+ * upstream buffer does not make the whole mix fall back to scalar. */
+void MIX_FUNC(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples)
+{
+	uint32_t n, i, head, unrolled, remain;
+	bool aligned = true;
+	MIX_VEC in[4];
+	float t;
+
+	if (n_src == 0) {
+		memset(dst, 0, n_samples * sizeof(float));
+		return;
+	}
+
+	head = SPA_MIN((uint32_t)((-(uintptr_t)dst & (MIX_ALIGN - 1)) / sizeof(float)), n_samples);
+
+	for (n = 0; n < head; n++) {
+		t = src[0][n];
+		for (i = 1; i < n_src; i++)
+			t += src[i][n];
+		dst[n] = t;
+	}
+
+	for (i = 0; i < n_src; i++) {
+		if (!SPA_IS_ALIGNED(&src[i][n], MIX_ALIGN)) {
+			aligned = false;
+			break;
+		}
+	}
+
+	unrolled = (n_samples - n) / MIX_UNROLL;
+	remain = ((n_samples - n) % MIX_UNROLL) / MIX_WIDTH;
+
+	if (aligned) {
+		MIX_BLOCK(MIX_LOAD);
+	} else {
+		MIX_BLOCK(MIX_LOADU);
+	}
+
+	for (; n < n_samples; n++) {
+		t = src[0][n];
+		for (i = 1; i < n_src; i++)
+			t += src[i][n];
+		dst[n] = t;
+	}
+}
+
+#undef MIX_BLOCK
+#undef MIX_UNROLL
+#undef MIX_ALIGN
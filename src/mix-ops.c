@@ -0,0 +1,66 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <spa/support/cpu.h>
+
+#include "mix-ops.h"
+
+void mix_f32_c(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples)
+{
+	uint32_t n, i;
+
+	if (n_src == 0) {
+		memset(dst, 0, n_samples * sizeof(float));
+		return;
+	}
+	for (n = 0; n < n_samples; n++) {
+		float t = src[0][n];
+		for (i = 1; i < n_src; i++)
+			t += src[i][n];
+		dst[n] = t;
+	}
+}
+
+#define MATCH_CPU_FLAGS(a,b)	((a) == 0 || ((a) & (b)) == (a))
+
+/* best first */
+static const struct mix_info mix_table[] =
+{
+#if defined (HAVE_AVX512)
+	{ "avx512", SPA_CPU_FLAG_AVX512, mix_f32_avx512 },
+#endif
+#if defined (HAVE_AVX)
+	{ "avx", SPA_CPU_FLAG_AVX, mix_f32_avx },
+#endif
+#if defined (HAVE_SSE)
+	{ "sse", SPA_CPU_FLAG_SSE, mix_f32_sse },
+#endif
+	{ "c", 0, mix_f32_c },
+};
+
+const struct mix_info *mix_find_info(uint32_t cpu_flags)
+{
+	size_t i;
+
+	for (i = 0; i < SPA_N_ELEMENTS(mix_table); i++) {
+		if (MATCH_CPU_FLAGS(mix_table[i].cpu_flags, cpu_flags))
+			return &mix_table[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,52 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef PIPEWIRE_JACK_MIX_OPS_H
+#define PIPEWIRE_JACK_MIX_OPS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <spa/utils/defs.h>
+
+/* sum n_src input buffers into dst in one pass over the samples, no input
+ * gives silence */
+typedef void (*mix_func_t) (float *dst, const float *src[], uint32_t n_src, uint32_t n_samples);
+
+struct mix_info {
+	const char *name;
+	uint32_t cpu_flags;
+	mix_func_t func;
+};
+
+const struct mix_info *mix_find_info(uint32_t cpu_flags);
+
+void mix_f32_c(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples);
+
+#if defined (HAVE_SSE)
+void mix_f32_sse(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples);
+#endif
+#if defined (HAVE_AVX)
+void mix_f32_avx(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples);
+#endif
+#if defined (HAVE_AVX512)
+void mix_f32_avx512(float *dst, const float *src[], uint32_t n_src, uint32_t n_samples);
+#endif
+
+#endif /* PIPEWIRE_JACK_MIX_OPS_H */
@@ -0,0 +1,88 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef PIPEWIRE_JACK_EXTENSIONS_H
+#define PIPEWIRE_JACK_EXTENSIONS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <jack/types.h>
+
+/**
+ * Fill \a names with at most \a max_names full names of the ports
+ * connected to \a port. The names are owned by the client and are
+ * valid until the port is unregistered.
+ *
+ * Unlike jack_port_get_all_connections() this does not allocate.
+ *
+ * @return the total number of connections, which can be larger than
+ * \a max_names, or a negative error code.
+ */
+int jack_port_get_all_connections_noalloc (const jack_client_t *client,
+                                           const jack_port_t *port,
+                                           const char **names, int max_names);
+
+/**
+ * Fill \a cpus with at most \a max_cpus of the CPUs that the threads of
+ * \a client run on. With \a realtime set these are the CPUs of the
+ * process thread and the realtime threads made with
+ * jack_client_create_thread(), otherwise the CPUs of the other threads.
+ *
+ * The CPUs are selected with PIPEWIRE_JACK_RT_CPUS or the jack.rt-cpus
+ * property, as a list like "2,3" or "2-3". The kernel does not allow a
+ * deadline task with a restricted affinity, with jack.rt-deadline the
+ * process thread is not pinned.
+ *
+ * @return the total number of CPUs, which can be larger than \a max_cpus,
+ * 0 when the threads are not pinned, or a negative error code.
+ */
+int jack_client_get_cpu_placement (const jack_client_t *client, int realtime,
+                                   int *cpus, int max_cpus);
+
+/**
+ * Statistics of the port buffer of a MIDI port.
+ */
+typedef struct {
+	uint32_t buffer_size;	/**< size of the port buffer in bytes */
+	uint32_t max_used;	/**< the most bytes used in one cycle */
+	uint32_t max_events;	/**< the most events in one cycle */
+	uint64_t events;	/**< events written or read */
+	uint64_t lost_events;	/**< events that were dropped */
+} jack_midi_port_stats_t;
+
+/**
+ * Get the statistics of the MIDI port \a port of this client.
+ *
+ * The size of the port buffer follows the largest quantum that the client
+ * asked for or that the graph ran with, or the jack.midi-buffer-size
+ * property or PIPEWIRE_JACK_MIDI_BUFFER_SIZE, and the buffer size in frames
+ * given to jack_port_register(), whichever is larger. Frames count as
+ * sizeof(float) bytes, like the quantum.
+ *
+ * @return 0 on success or a negative error code.
+ */
+int jack_port_get_midi_stats (const jack_port_t *port, jack_midi_port_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPEWIRE_JACK_EXTENSIONS_H */
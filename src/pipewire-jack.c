@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <regex.h>
 #include <math.h>
 
@@ -34,6 +36,7 @@
 #include <jack/uuid.h>
 
 #include <spa/support/cpu.h>
+#include <spa/utils/ringbuffer.h>
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/video/format-utils.h>
 #include <spa/debug/types.h>
@@ -45,23 +48,30 @@
 
 #include "extensions/client-node.h"
 
+#include "mix-ops.h"
+#include "pipewire-jack-extensions.h"
+
 #define JACK_DEFAULT_VIDEO_TYPE	"32 bit float RGBA video"
 
 #define JACK_CLIENT_NAME_SIZE		64
 #define JACK_PORT_NAME_SIZE		256
-#define JACK_PORT_MAX			4096
 #define JACK_PORT_TYPE_SIZE             32
-#define CONNECTION_NUM_FOR_PORT		1024
 
-#define MAX_BUFFER_FRAMES		8192
+#define DEFAULT_SPIN_USEC	0
+#define DEFAULT_RT_PRIORITY	20
+#define DEFAULT_RT_POLICY	SCHED_FIFO
+#define DEFAULT_RT_STACK	(128 * 1024)
+#define SPIN_CHECK_INTERVAL	64
+#define MAX_INLINE_CYCLES	16
+
+#define DEFAULT_MAX_BUFFER_FRAMES	8192
+#define MIN_MIDI_BUFFER_SIZE		4096
 
 #define MAX_ALIGN			16
 #define MAX_OBJECTS			8192
-#define MAX_PORTS			1024
 #define MAX_BUFFERS			2
 #define MAX_BUFFER_DATAS		4u
 #define MAX_BUFFER_MEMS			4
-#define MAX_MIX				4096
 #define MAX_IO				32
 
 #define DEFAULT_SAMPLE_RATE	48000
@@ -77,15 +87,17 @@ struct port;
 
 struct globals {
 	jack_thread_creator_t creator;
+	pthread_mutex_t lock;
+	mix_func_t mix_function;
 };
 
-static struct globals globals;
+static struct globals globals = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 #define OBJECT_CHUNK	8
-
-typedef void (*mix2_func) (float *dst, float *src1, float *src2, int n_samples);
-
-static mix2_func mix2;
+#define PORT_CHUNK	8
+#define MIX_CHUNK	16
 
 struct object {
 	struct spa_list link;
@@ -95,6 +107,15 @@ struct object {
 	uint32_t type;
 	uint32_t id;
 
+	/* ports are hashed on their name, links on their ports */
+	uint32_t hash;
+	struct object *hash_next;
+
+	/* queued notifications about the object, it is only reused after
+	 * they were dispatched */
+	uint32_t refs;
+	bool removed;
+
 	union {
 		struct {
 			char name[JACK_CLIENT_NAME_SIZE+1];
@@ -103,6 +124,8 @@ struct object {
 		struct {
 			uint32_t src;
 			uint32_t dst;
+			struct spa_list src_link;
+			struct spa_list dst_link;
 		} port_link;
 		struct {
 			unsigned long flags;
@@ -112,6 +135,10 @@ struct object {
 			uint32_t type_id;
 			uint32_t node_id;
 			uint32_t port_id;
+			struct port *port;
+			struct spa_list src_links;	/* links with this port as src */
+			struct spa_list dst_links;	/* links with this port as dst */
+			uint32_t graph_index;
 			uint32_t monitor_requests;
 			jack_latency_range_t capture_latency;
 			jack_latency_range_t playback_latency;
@@ -132,6 +159,28 @@ struct midi_buffer {
 
 #define MIDI_INLINE_MAX	4
 
+/* An input port with one connection gets a view on the control sequence of
+ * the peer instead of a copy of the events. The index of the MIDI events is
+ * made when the events are first asked for.
+ *
+ * An output port gets a view on the sequence in its outgoing buffer, with
+ * maxsize set, and events are encoded into it as they are written. */
+struct midi_view {
+	struct midi_buffer mb;		/* with MIDI_VIEW_MAGIC */
+#define MIDI_VIEW_MAGIC 0x900dface
+	struct spa_pod_sequence *seq;
+	uint32_t maxsize;		/* writable size of seq, 0 for input */
+	bool indexed;
+	uint32_t index[];		/* offsets of the events in seq */
+};
+
+/* the next event of one of the merged sequences */
+struct midi_cursor {
+	struct spa_pod_sequence *seq;
+	struct spa_pod_control *c;
+	uint32_t index;
+};
+
 struct midi_event {
 	uint16_t time;
         uint16_t size;
@@ -162,6 +211,17 @@ struct link {
 	int signalfd;
 };
 
+/* What the RT thread needs to signal the peers, in one allocation. The table
+ * is built from the links in the protocol thread and swapped in the data
+ * loop. */
+struct signal_table {
+	uint32_t n_links;
+	struct pw_node_activation_state **state;
+	struct pw_node_activation **activation;
+	int *signalfd;
+	uint32_t *node_id;
+};
+
 struct mix {
 	struct spa_list link;
 	struct spa_list port_link;
@@ -188,12 +248,103 @@ struct port {
 	struct spa_io_buffers io;
 	struct spa_list mix;
 
+	/* in the list of MIDI outputs of the client */
+	struct spa_list midi_link;
+
+	/* MIDI buffer size in bytes asked for in jack_port_register() and the size
+	 * that is negotiated, with the totals of the past cycles */
+	uint32_t size_hint;
+	uint32_t midi_size;
+	jack_midi_port_stats_t midi_stats;
+
 	bool have_format;
 	uint32_t rate;
 
+	/* buffer returned by jack_port_get_buffer() in this cycle */
+	uint64_t buffer_cycle;
+	jack_nframes_t buffer_frames;
+	void *buffer_ptr;
+
+	/* silence and mix buffer, grows with the negotiated buffer size */
 	bool zeroed;
+	uint32_t empty_frames;
 	float *emptyptr;
-	float empty[MAX_BUFFER_FRAMES + MAX_ALIGN];
+
+	/* the data pointers of the mix inputs, grows with the number of mixes,
+	 * and the merge heap of MIDI ports */
+	uint32_t n_mix;
+	uint32_t max_mix;
+	void **mix_data;
+	struct midi_cursor *mix_cursors;
+};
+
+struct object_hash {
+	struct object **table;
+	uint32_t size;
+	uint32_t n_objects;
+};
+
+#define OBJECT_HASH_MIN_SIZE	64
+
+#define object_hash_for_each(o,h,hs)							\
+	for (o = (h)->size ? (h)->table[(hs) & ((h)->size - 1)] : NULL; o; o = o->hash_next)
+
+/* compiled port and type patterns of jack_get_ports() */
+struct pattern {
+	char *str;
+	uint64_t last_use;
+#define PATTERN_REGEX		0
+#define PATTERN_EXACT		1
+#define PATTERN_PREFIX		2
+#define PATTERN_SUFFIX		3
+#define PATTERN_SUBSTRING	4
+	uint32_t type;
+	char *literal;
+	size_t len;
+	bool compiled;
+	regex_t regex;
+};
+
+#define MAX_PATTERNS	16
+
+/* audio, midi and video ports can be listed with jack_get_ports() */
+#define N_PORT_TYPES	3
+
+/* A copy of the ports and links for the query functions. A graph is
+ * never changed once it is published, a new one is made when a reader
+ * comes after registry changes. The names and aliases are copied, the
+ * names that are returned to the application are the ones of the
+ * objects, which are never freed. */
+struct graph_port {
+	struct object *object;
+	uint32_t id;
+	uint32_t type_id;
+	unsigned long flags;
+	uint32_t node_id;
+	uint32_t name_hash;
+	const char *name;
+	const char *alias1;
+	const char *alias2;
+	uint32_t n_peers;
+	uint32_t *peers;
+};
+
+/* the port flags from JackPortIsInput to JackPortIsTerminal have a bitmap
+ * of the listed ports, jack_get_ports() combines the ones it asks for */
+#define GRAPH_N_FLAGS	5
+
+struct graph {
+	struct spa_list link;
+	uint32_t n_ports;
+	uint32_t n_listed;	/* the first ports are in jack_get_ports() order */
+	uint32_t type_offset[N_PORT_TYPES + 1];
+	struct graph_port *ports;
+	uint32_t n_words;
+	uint64_t *flag_bits;	/* GRAPH_N_FLAGS bitmaps of n_words */
+	uint32_t hash_size;
+	uint32_t *by_name;	/* port index + 1, open addressing */
+	uint32_t *by_id;
+	uint32_t *by_object;
 };
 
 struct context {
@@ -206,13 +357,99 @@ struct context {
 	struct spa_list ports;
 	struct spa_list nodes;
 	struct spa_list links;
+	/* links of which the port was not announced yet, on their
+	 * src_link and dst_link */
+	struct spa_list pending_src_links;
+	struct spa_list pending_dst_links;
+
+	struct object_hash port_names;
+	struct object_hash link_ports;
+
+	/* the announced ports of each type in jack_get_ports() order */
+	struct pw_array port_index[N_PORT_TYPES];
+
+	pthread_mutex_t pattern_lock;
+	struct pattern patterns[MAX_PATTERNS];
+	uint32_t n_patterns;
+	uint64_t pattern_serial;
+
+	struct graph *graph;
+	uint32_t graph_readers;
+	struct spa_list graph_retired;
+	uint32_t graph_n_retired;
+	struct spa_source *batch_event;
+	bool graph_dirty;
+	bool graph_wanted;
+};
+
+/* registry changes for the application callbacks */
+struct notification {
+#define NOTIFY_CLIENT_REGISTER	0
+#define NOTIFY_PORT_REGISTER	1
+#define NOTIFY_PORT_CONNECT	2
+#define NOTIFY_PORT_RENAME	3
+	uint32_t type;
+	int reg;
+	uint32_t id;
+	uint32_t dst;
+	char name[JACK_CLIENT_NAME_SIZE+1];
+	char *old_name;
+	char *new_name;
+	struct object *object;
+};
+
+struct notify_batch {
+	struct spa_list link;
+	struct pw_array items;
 };
 
 #define GET_DIRECTION(f)	((f) & JackPortIsInput ? SPA_DIRECTION_INPUT : SPA_DIRECTION_OUTPUT)
 
-#define GET_IN_PORT(c,p)	(&c->port_pool[SPA_DIRECTION_INPUT][p])
-#define GET_OUT_PORT(c,p)	(&c->port_pool[SPA_DIRECTION_OUTPUT][p])
-#define GET_PORT(c,d,p)		(d == SPA_DIRECTION_INPUT ? GET_IN_PORT(c,p) : GET_OUT_PORT(c,p))
+/* The process thread does not log itself, it writes records in a ring that
+ * is formatted and logged from the notify thread. The first record after a
+ * flush wakes up the notify thread, which arms a timer to collect the others
+ * that follow. */
+enum rt_log_type {
+	RT_LOG_READ_FAILED,
+	RT_LOG_MISSED_WAKEUPS,
+	RT_LOG_OUT_OF_BUFFERS,
+	RT_LOG_WRITE_FAILED,
+	RT_LOG_MIDI_TIME,
+	RT_LOG_MIDI_ORDER,
+	RT_LOG_MIDI_SIZE,
+	RT_LOG_MIDI_TOO_LARGE,
+	RT_LOG_N_TYPES,
+};
+
+struct rt_log_entry {
+	uint32_t type;
+	int err;
+	const void *obj;
+	uint64_t val1;
+	uint64_t val2;
+};
+
+#define RT_LOG_SIZE		64
+#define RT_LOG_MASK		(RT_LOG_SIZE - 1)
+#define RT_LOG_INTERVAL_MSEC	250
+#define RT_LOG_RATE_NSEC	SPA_NSEC_PER_SEC
+
+struct rt_log {
+	struct spa_ringbuffer ring;
+	struct rt_log_entry entries[RT_LOG_SIZE];
+	uint32_t dropped;
+	bool pending;
+
+	/* only used by the reader, at most one message per type
+	 * every RT_LOG_RATE_NSEC, the others are counted and logged
+	 * when the period ends */
+	uint64_t last_time[RT_LOG_N_TYPES];
+	uint32_t suppressed[RT_LOG_N_TYPES];
+	bool armed;
+};
+
+#define GET_PORT(c,d,p)		((p) < (c)->n_ports[d] ?					\
+		*pw_array_get_unchecked(&(c)->port_pool[d], p, struct port*) : NULL)
 
 struct client {
 	char name[JACK_CLIENT_NAME_SIZE+1];
@@ -220,6 +457,7 @@ struct client {
 	struct context context;
 
 	struct pw_data_loop *loop;
+	struct pw_properties *props;
 
 	struct pw_remote *remote;
 	struct spa_hook remote_listener;
@@ -277,15 +515,25 @@ struct client {
 	struct spa_io_position *position;
 	uint32_t sample_rate;
 	uint32_t buffer_frames;
-
-	struct mix mix_pool[MAX_MIX];
+	uint32_t max_frames;
+	uint32_t quantum;		/* largest quantum asked for or run with */
+	uint32_t graph_frames;		/* largest quantum the graph ran with */
+	uint32_t midi_buffer_size;	/* 0 to size MIDI buffers on the quantum */
+	uint64_t cycle;
+
+	/* mixes and ports are allocated in chunks when needed */
+	struct pw_array slabs;		/* struct slab */
 	struct spa_list free_mix;
+	uint32_t n_mix;
 
-	struct port port_pool[2][MAX_PORTS];
+	struct pw_array port_pool[2];
+	uint32_t n_ports[2];
 	struct spa_list ports[2];
 	struct spa_list free_ports[2];
+	struct spa_list midi_outputs;	/* the process_tee() ports */
 
-	struct pw_array links;
+	struct pw_array links;		/* sorted on node_id */
+	struct signal_table *signals;
 	uint32_t driver_id;
 	struct pw_node_activation *driver_activation;
 
@@ -293,29 +541,183 @@ struct client {
 	struct pw_node_activation *activation;
 	uint32_t xrun_count;
 
+	/* when not 0, poll the activation for this long before
+	 * blocking on the eventfd */
+	uint64_t spin_nsec;
+	uint64_t spin_hits;
+	uint64_t spin_fallbacks;
+
+	/* used for the data thread when it is not realtime yet, and the
+	 * policy of the realtime threads of this client */
+	int rt_priority;
+	int rt_policy;
+
+	/* when not 0, the data thread runs as a deadline task with this
+	 * percentage of the period as runtime. It is set up from the notify
+	 * thread, for the period of the last attempt, when the data thread
+	 * signals a new quantum or rate. */
+	uint32_t deadline_percent;
+	bool deadline_active;
+	uint64_t deadline_period;
+	pid_t data_tid;
+	struct spa_source *deadline_event;
+
+	/* when set, the realtime threads run on rt_cpus and the other
+	 * threads of the client on other_cpus */
+	bool have_rt_cpus;
+	cpu_set_t rt_cpus;
+	cpu_set_t other_cpus;
+
 	unsigned int started:1;
 	unsigned int active:1;
 	unsigned int destroyed:1;
 	unsigned int first:1;
 	unsigned int thread_entered:1;
+	unsigned int flush_denormals:1;
+	unsigned int lock_memory:1;
+
+	/* what was locked for the RT thread, the failures are also counted
+	 * from the data thread */
+	size_t rt_stack_size;
+	uint32_t lock_failures;
 
 	jack_position_t jack_position;
 	jack_transport_state_t jack_state;
+
+	/* the callbacks for registry changes are called from their own
+	 * thread, one batch at a time */
+	struct pw_array notify_pending;
+	pthread_mutex_t notify_lock;
+	struct spa_list notify_batches;
+	struct pw_loop *notify_loop;
+	struct pw_thread_loop *notify_thread;
+	struct spa_source *notify_event;
+
+	struct rt_log rt_log;
+	struct spa_source *rt_log_event;
+	struct spa_source *rt_log_timer;
 };
 
 static void init_port_pool(struct client *c, enum spa_direction direction)
 {
-	int i;
-
 	spa_list_init(&c->ports[direction]);
 	spa_list_init(&c->free_ports[direction]);
-	for (i = 0; i < MAX_PORTS; i++) {
-		c->port_pool[direction][i].direction = direction;
-		c->port_pool[direction][i].id = i;
-		c->port_pool[direction][i].emptyptr =
-			SPA_PTR_ALIGN(c->port_pool[direction][i].empty, MAX_ALIGN, float);
-		spa_list_append(&c->free_ports[direction], &c->port_pool[direction][i].link);
+	pw_array_init(&c->port_pool[direction], PORT_CHUNK * sizeof(struct port *));
+	c->n_ports[direction] = 0;
+}
+
+struct slab {
+	void *data;
+	size_t size;
+};
+
+/* mlock() also faults the pages in. Heap memory is never unlocked, the
+ * locks are per page and would be dropped for the neighbours too. */
+static int lock_memory(struct client *c, void *data, size_t size)
+{
+	if (data == NULL || size == 0)
+		return 0;
+
+	if (mlock(data, size) < 0) {
+		pw_log_warn(NAME" %p: Failed to mlock memory %p %zu: %m", c, data, size);
+		ATOMIC_INC(c->lock_failures);
+		return -errno;
+	}
+	return 0;
+}
+
+/* memory is unlocked when it is unmapped or the thread exits, ask the
+ * kernel what is locked now in the whole process */
+static size_t get_locked_bytes(void)
+{
+	FILE *f;
+	char line[128];
+	size_t kb = 0;
+
+	if ((f = fopen("/proc/self/status", "re")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmLck: %zu kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb * 1024;
+}
+
+static void lock_memmap(struct client *c, struct pw_memmap *mm)
+{
+	if (c->lock_memory && mm != NULL)
+		lock_memory(c, mm->ptr, mm->size);
+}
+
+static void *alloc_slab(struct client *c, size_t n_elem, size_t size)
+{
+	struct slab *slab;
+	void *data;
+
+	if ((data = calloc(n_elem, size)) == NULL)
+		return NULL;
+
+	if ((slab = pw_array_add(&c->slabs, sizeof(struct slab))) == NULL) {
+		free(data);
+		return NULL;
+	}
+	slab->data = data;
+	slab->size = n_elem * size;
+
+	if (c->lock_memory)
+		lock_memory(c, slab->data, slab->size);
+
+	return data;
+}
+
+static void free_slabs(struct client *c)
+{
+	struct slab *slab;
+
+	pw_array_for_each(slab, &c->slabs)
+		free(slab->data);
+	pw_array_clear(&c->slabs);
+}
+
+static int grow_port_pool(struct client *c, enum spa_direction direction)
+{
+	struct port *p, **pp;
+	uint32_t i, n_ports;
+
+	n_ports = c->n_ports[direction];
+
+	if ((p = alloc_slab(c, PORT_CHUNK, sizeof(struct port))) == NULL)
+		return -errno;
+
+	if ((pp = pw_array_add(&c->port_pool[direction], PORT_CHUNK * sizeof(struct port *))) == NULL)
+		return -errno;
+
+	for (i = 0; i < PORT_CHUNK; i++) {
+		p[i].direction = direction;
+		p[i].id = n_ports + i;
+		pp[i] = &p[i];
+		spa_list_append(&c->free_ports[direction], &p[i].link);
 	}
+	c->n_ports[direction] += PORT_CHUNK;
+
+	pw_log_debug(NAME" %p: %d ports in pool %d", c, c->n_ports[direction], direction);
+	return 0;
+}
+
+static int grow_mix_pool(struct client *c)
+{
+	struct mix *mix;
+	uint32_t i;
+
+	if ((mix = alloc_slab(c, MIX_CHUNK, sizeof(struct mix))) == NULL)
+		return -errno;
+
+	for (i = 0; i < MIX_CHUNK; i++)
+		spa_list_append(&c->free_mix, &mix[i].link);
+	c->n_mix += MIX_CHUNK;
+
+	return 0;
 }
 
 static struct object * alloc_object(struct client *c)
@@ -334,198 +736,1281 @@ static struct object * alloc_object(struct client *c)
         o = spa_list_first(&c->context.free_objects, struct object, link);
         spa_list_remove(&o->link);
 	o->client = c;
+	o->type = SPA_ID_INVALID;
 
 	return o;
 }
 
-static void free_object(struct client *c, struct object *o)
-{
-        spa_list_remove(&o->link);
-	spa_list_append(&c->context.free_objects, &o->link);
-}
+static void graph_changed(struct client *c);
 
-static struct mix *find_mix(struct client *c, struct port *port, uint32_t mix_id)
+static inline uint32_t port_name_hash(const char *name)
 {
-	struct mix *mix;
+	uint32_t hash = 2166136261u;
 
-	spa_list_for_each(mix, &port->mix, port_link) {
-		if (mix->id == mix_id)
-			return mix;
+	while (*name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619u;
 	}
-	return NULL;
+	return hash;
 }
 
-static struct mix *ensure_mix(struct client *c, struct port *port, uint32_t mix_id)
+static inline uint32_t link_ports_hash(uint32_t src, uint32_t dst)
 {
-	struct mix *mix;
+	return (src * 2654435761u) ^ dst;
+}
 
-	if ((mix = find_mix(c, port, mix_id)) != NULL)
-		return mix;
+static int object_hash_resize(struct object_hash *h, uint32_t size)
+{
+	struct object **table, *o, *t;
+	uint32_t i;
 
-	if (spa_list_is_empty(&c->free_mix))
-		return NULL;
+	if ((table = calloc(size, sizeof(struct object *))) == NULL)
+		return -errno;
 
-	mix = spa_list_first(&c->free_mix, struct mix, link);
-	spa_list_remove(&mix->link);
+	for (i = 0; i < h->size; i++) {
+		for (o = h->table[i]; o; o = t) {
+			t = o->hash_next;
+			o->hash_next = table[o->hash & (size - 1)];
+			table[o->hash & (size - 1)] = o;
+		}
+	}
+	free(h->table);
+	h->table = table;
+	h->size = size;
+	return 0;
+}
 
-	spa_list_append(&port->mix, &mix->port_link);
+static int object_hash_insert(struct object_hash *h, struct object *o, uint32_t hash)
+{
+	uint32_t idx;
+	int res;
 
-	mix->id = mix_id;
-	mix->port = port;
-	mix->io = NULL;
-	mix->n_buffers = 0;
+	o->hash = hash;
 
-	return mix;
-}
+	if (h->n_objects >= h->size &&
+	    (res = object_hash_resize(h, SPA_MAX(h->size * 2, OBJECT_HASH_MIN_SIZE))) < 0)
+		return res;
 
-static void free_mix(struct client *c, struct mix *mix)
-{
-	spa_list_remove(&mix->link);
-	spa_list_remove(&mix->port_link);
-	spa_list_append(&c->free_mix, &mix->link);
+	idx = hash & (h->size - 1);
+	o->hash_next = h->table[idx];
+	h->table[idx] = o;
+	h->n_objects++;
+	return 0;
 }
 
-static struct port * alloc_port(struct client *c, enum spa_direction direction)
+static void object_hash_remove(struct object_hash *h, struct object *o)
 {
-	struct port *p;
-	struct object *o;
-
-	if (spa_list_is_empty(&c->free_ports[direction]))
-		return NULL;
+	struct object **op;
 
-	p = spa_list_first(&c->free_ports[direction], struct port, link);
-	spa_list_remove(&p->link);
+	if (h->size == 0)
+		return;
 
-	o = alloc_object(c);
-	o->type = PW_TYPE_INTERFACE_Port;
-	o->id = SPA_ID_INVALID;
-	o->port.node_id = c->node_id;
-	o->port.port_id = p->id;
-	spa_list_append(&c->context.ports, &o->link);
+	for (op = &h->table[o->hash & (h->size - 1)]; *op; op = &(*op)->hash_next) {
+		if (*op == o) {
+			*op = o->hash_next;
+			h->n_objects--;
+			break;
+		}
+	}
+}
 
-	p->valid = true;
-	p->zeroed = false;
-	p->client = c;
-	p->object = o;
-	spa_list_init(&p->mix);
+static void object_hash_clear(struct object_hash *h)
+{
+	free(h->table);
+	spa_zero(*h);
+}
 
-	spa_list_append(&c->ports[direction], &p->link);
+static void port_name_insert(struct client *c, struct object *o)
+{
+	int res;
 
-	return p;
+	if ((res = object_hash_insert(&c->context.port_names, o,
+					port_name_hash(o->port.name))) < 0)
+		pw_log_warn(NAME" %p: can't index port %s: %s", c,
+				o->port.name, spa_strerror(res));
+	graph_changed(c);
 }
 
-static void free_port(struct client *c, struct port *p)
+static void port_name_remove(struct client *c, struct object *o)
 {
-	struct mix *m, *t;
+	object_hash_remove(&c->context.port_names, o);
+	graph_changed(c);
+}
 
-	if (!p->valid)
-		return;
+static int port_compare(const struct object *o1, const struct object *o2)
+{
+	if (o1->port.type_id != o2->port.type_id)
+		return o1->port.type_id - o2->port.type_id;
 
-	spa_list_for_each_safe(m, t, &p->mix, port_link)
-		free_mix(c, m);
+	if (o1->port.priority != o2->port.priority)
+		return o2->port.priority - o1->port.priority;
 
-	spa_list_remove(&p->link);
-	p->valid = false;
-	free_object(c, p->object);
-	spa_list_append(&c->free_ports[p->direction], &p->link);
+	return o1->id - o2->id;
 }
 
-static struct object *find_port(struct client *c, const char *name)
+static uint32_t port_index_find(struct pw_array *index, const struct object *o)
 {
-	struct object *o;
+	struct object **ports = index->data;
+	uint32_t lo = 0, hi = pw_array_get_len(index, struct object *);
 
-	spa_list_for_each(o, &c->context.ports, link) {
-		if (!strcmp(o->port.name, name))
-			return o;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (port_compare(ports[mid], o) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return NULL;
+	return lo;
 }
 
-static struct object *find_link(struct client *c, uint32_t src, uint32_t dst)
+static void port_index_insert(struct client *c, struct object *o)
 {
-	struct object *l;
+	struct pw_array *index;
+	struct object **ports;
+	uint32_t pos, n_ports;
 
-	spa_list_for_each(l, &c->context.links, link) {
-		if (l->port_link.src == src &&
-		    l->port_link.dst == dst) {
-			return l;
-		}
+	if (o->port.type_id >= N_PORT_TYPES)
+		return;
+
+	index = &c->context.port_index[o->port.type_id];
+	pos = port_index_find(index, o);
+
+	if (pw_array_add(index, sizeof(struct object *)) == NULL) {
+		pw_log_warn(NAME" %p: can't index port %s: %m", c, o->port.name);
+		return;
 	}
-	return NULL;
+	ports = index->data;
+	n_ports = pw_array_get_len(index, struct object *);
+	memmove(&ports[pos + 1], &ports[pos], (n_ports - pos - 1) * sizeof(struct object *));
+	ports[pos] = o;
+	graph_changed(c);
 }
 
-static struct buffer *dequeue_buffer(struct mix *mix)
+static void port_index_remove(struct client *c, struct object *o)
 {
-        struct buffer *b;
+	struct pw_array *index;
+	struct object **ports;
+	uint32_t pos, n_ports;
 
-        if (spa_list_is_empty(&mix->queue))
-                return NULL;
+	if (o->port.type_id >= N_PORT_TYPES)
+		return;
 
-        b = spa_list_first(&mix->queue, struct buffer, link);
-        spa_list_remove(&b->link);
-	SPA_FLAG_SET(b->flags, BUFFER_FLAG_OUT);
+	index = &c->context.port_index[o->port.type_id];
+	pos = port_index_find(index, o);
+	ports = index->data;
+	n_ports = pw_array_get_len(index, struct object *);
 
-        return b;
+	if (pos >= n_ports || ports[pos] != o)
+		return;
+
+	memmove(&ports[pos], &ports[pos + 1], (n_ports - pos - 1) * sizeof(struct object *));
+	index->size -= sizeof(struct object *);
+	graph_changed(c);
 }
 
-#if defined (__SSE__)
-#include <xmmintrin.h>
-static void mix2_sse(float *dst, float *src1, float *src2, int n_samples)
+static void pattern_init(struct client *c, struct pattern *p, const char *str)
 {
-	int n, unrolled;
-	__m128 in[2];
+	const char *lit = str;
+	size_t len = strlen(str);
+	bool start = false, end = false;
 
-	if (SPA_IS_ALIGNED(src1, 16) &&
-	    SPA_IS_ALIGNED(src2, 16) &&
-	    SPA_IS_ALIGNED(dst, 16))
-		unrolled = n_samples / 4;
-	else
-		unrolled = 0;
+	p->str = strdup(str);
+	p->literal = NULL;
+	p->compiled = false;
 
-	for (n = 0; unrolled--; n += 4) {
-		in[0] = _mm_load_ps(&src1[n]),
-		in[1] = _mm_load_ps(&src2[n]),
-		in[0] = _mm_add_ps(in[0], in[1]);
-		_mm_store_ps(&dst[n], in[0]);
+	if (lit[0] == '^') {
+		start = true;
+		lit++;
+		len--;
+	}
+	if (len > 0 && lit[len - 1] == '$') {
+		end = true;
+		len--;
 	}
-	for (; n < n_samples; n++) {
-		in[0] = _mm_load_ss(&src1[n]),
-		in[1] = _mm_load_ss(&src2[n]),
-		in[0] = _mm_add_ss(in[0], in[1]);
-		_mm_store_ss(&dst[n], in[0]);
+	/* patterns without special characters are matched with string
+	 * functions, this covers most patterns used by applications */
+	if (strcspn(lit, ".[]()*+?{}|\\^$") >= len &&
+	    (p->literal = strndup(lit, len)) != NULL) {
+		p->len = len;
+		if (start && end)
+			p->type = PATTERN_EXACT;
+		else if (start)
+			p->type = PATTERN_PREFIX;
+		else if (end)
+			p->type = PATTERN_SUFFIX;
+		else
+			p->type = PATTERN_SUBSTRING;
+		return;
 	}
+
+	p->type = PATTERN_REGEX;
+	if (regcomp(&p->regex, str, REG_EXTENDED | REG_NOSUB) == 0)
+		p->compiled = true;
+	else
+		pw_log_warn(NAME" %p: invalid pattern \"%s\"", c, str);
 }
-#endif
 
-static void mix2_c(float *dst, float *src1, float *src2, int n_samples)
+static void pattern_clear(struct pattern *p)
 {
-	int i;
-	for (i = 0; i < n_samples; i++)
-		dst[i] = src1[i] + src2[i];
+	if (p->compiled)
+		regfree(&p->regex);
+	free(p->literal);
+	free(p->str);
+	spa_zero(*p);
 }
 
-SPA_EXPORT
-void jack_get_version(int *major_ptr, int *minor_ptr, int *micro_ptr, int *proto_ptr)
+static struct pattern *find_pattern(struct client *c, const char *str)
 {
-	*major_ptr = 0;
-	*minor_ptr = 0;
-	*micro_ptr = 0;
-	*proto_ptr = 0;
+	struct context *ctx = &c->context;
+	struct pattern *p, *lru = NULL;
+	uint32_t i;
+
+	for (i = 0; i < ctx->n_patterns; i++) {
+		p = &ctx->patterns[i];
+		if (p->str != NULL && !strcmp(p->str, str))
+			goto done;
+		if (lru == NULL || p->last_use < lru->last_use)
+			lru = p;
+	}
+	if (ctx->n_patterns < MAX_PATTERNS) {
+		p = &ctx->patterns[ctx->n_patterns++];
+	} else {
+		p = lru;
+		pattern_clear(p);
+	}
+	pattern_init(c, p, str);
+	if (p->str == NULL) {
+		pattern_clear(p);
+		return NULL;
+	}
+      done:
+	p->last_use = ++ctx->pattern_serial;
+	return p;
 }
 
-SPA_EXPORT
-const char *
-jack_get_version_string(void)
+static void clear_patterns(struct client *c)
 {
-	return "0.0.0.0";
+	uint32_t i;
+
+	for (i = 0; i < c->context.n_patterns; i++)
+		pattern_clear(&c->context.patterns[i]);
+	c->context.n_patterns = 0;
 }
 
-static void on_state_changed(void *data, enum pw_remote_state old,
-                             enum pw_remote_state state, const char *error)
+static bool pattern_match(const struct pattern *p, const char *str)
 {
-	struct client *client = data;
+	size_t len;
 
-	pw_log_debug(NAME" %p: state %s", client, pw_remote_state_as_string(state));
+	switch (p->type) {
+	case PATTERN_EXACT:
+		return strcmp(str, p->literal) == 0;
+	case PATTERN_PREFIX:
+		return strncmp(str, p->literal, p->len) == 0;
+	case PATTERN_SUFFIX:
+		len = strlen(str);
+		return len >= p->len && memcmp(str + len - p->len, p->literal, p->len) == 0;
+	case PATTERN_SUBSTRING:
+		return strstr(str, p->literal) != NULL;
+	default:
+		return p->compiled && regexec(&p->regex, str, 0, NULL, 0) == 0;
+	}
+}
+
+static void init_port_links(struct object *o)
+{
+	spa_list_init(&o->port.src_links);
+	spa_list_init(&o->port.dst_links);
+}
+
+/* called when the port object goes away before its links */
+static void clear_port_links(struct client *c, struct object *o)
+{
+	struct object *l;
+
+	spa_list_consume(l, &o->port.src_links, port_link.src_link) {
+		spa_list_remove(&l->port_link.src_link);
+		spa_list_append(&c->context.pending_src_links, &l->port_link.src_link);
+	}
+	spa_list_consume(l, &o->port.dst_links, port_link.dst_link) {
+		spa_list_remove(&l->port_link.dst_link);
+		spa_list_append(&c->context.pending_dst_links, &l->port_link.dst_link);
+	}
+}
+
+/* a link can be announced before its ports, when the port reuses the id
+ * of an older object, pick up the links that wait for the new port */
+static void attach_port_links(struct client *c, struct object *o, uint32_t id)
+{
+	struct object *l, *t;
+
+	spa_list_for_each_safe(l, t, &c->context.pending_src_links, port_link.src_link) {
+		if (l->port_link.src != id)
+			continue;
+		spa_list_remove(&l->port_link.src_link);
+		spa_list_append(&o->port.src_links, &l->port_link.src_link);
+	}
+	spa_list_for_each_safe(l, t, &c->context.pending_dst_links, port_link.dst_link) {
+		if (l->port_link.dst != id)
+			continue;
+		spa_list_remove(&l->port_link.dst_link);
+		spa_list_append(&o->port.dst_links, &l->port_link.dst_link);
+	}
+}
+
+static void add_link(struct client *c, struct object *l)
+{
+	struct object *p;
+	int res;
+
+	p = pw_map_lookup(&c->context.globals, l->port_link.src);
+	if (p != NULL && p->type == PW_TYPE_INTERFACE_Port)
+		spa_list_append(&p->port.src_links, &l->port_link.src_link);
+	else
+		spa_list_append(&c->context.pending_src_links, &l->port_link.src_link);
+
+	p = pw_map_lookup(&c->context.globals, l->port_link.dst);
+	if (p != NULL && p->type == PW_TYPE_INTERFACE_Port)
+		spa_list_append(&p->port.dst_links, &l->port_link.dst_link);
+	else
+		spa_list_append(&c->context.pending_dst_links, &l->port_link.dst_link);
+
+	if ((res = object_hash_insert(&c->context.link_ports, l,
+			link_ports_hash(l->port_link.src, l->port_link.dst))) < 0)
+		pw_log_warn(NAME" %p: can't index link %d->%d: %s", c,
+				l->port_link.src, l->port_link.dst, spa_strerror(res));
+	graph_changed(c);
+}
+
+static void remove_link(struct client *c, struct object *l)
+{
+	spa_list_remove(&l->port_link.src_link);
+	spa_list_remove(&l->port_link.dst_link);
+	object_hash_remove(&c->context.link_ports, l);
+	graph_changed(c);
+}
+
+/* the client of the process thread, for the functions that only get a
+ * buffer and for the ones that must not take the thread loop lock */
+static __thread struct client *rt_client;
+
+static inline uint32_t id_hash(uint32_t id)
+{
+	return id * 2654435761u;
+}
+
+static inline uint32_t object_ptr_hash(const struct object *o)
+{
+	return id_hash((uint32_t) ((uintptr_t) o >> 4));
+}
+
+static void graph_hash_insert(struct graph *g, uint32_t *table, uint32_t hash, uint32_t index)
+{
+	uint32_t mask = g->hash_size - 1;
+
+	while (table[hash & mask] != 0)
+		hash++;
+	table[hash & mask] = index + 1;
+}
+
+#define graph_hash_for_each(p,g,table,hs)						\
+	for (uint32_t _h = (hs), _i;							\
+	     (_i = (table)[_h & ((g)->hash_size - 1)]) != 0 && (p = &(g)->ports[_i - 1]);	\
+	     _h++)
+
+static const struct graph_port *graph_find_name(struct graph *g, const char *name)
+{
+	const struct graph_port *p;
+	uint32_t hash = port_name_hash(name);
+
+	graph_hash_for_each(p, g, g->by_name, hash) {
+		if (p->name_hash == hash && !strcmp(p->name, name))
+			return p;
+	}
+	return NULL;
+}
+
+static const struct graph_port *graph_find_id(struct graph *g, uint32_t id)
+{
+	const struct graph_port *p;
+
+	graph_hash_for_each(p, g, g->by_id, id_hash(id)) {
+		if (p->id == id)
+			return p;
+	}
+	return NULL;
+}
+
+static const struct graph_port *graph_find_object(struct graph *g, const struct object *o)
+{
+	const struct graph_port *p;
+
+	graph_hash_for_each(p, g, g->by_object, object_ptr_hash(o)) {
+		if (p->object == o)
+			return p;
+	}
+	return NULL;
+}
+
+static inline size_t graph_string_size(const char *str)
+{
+	return str[0] ? strlen(str) + 1 : 0;
+}
+
+static inline const char *graph_string(char **strings, const char *str)
+{
+	size_t len;
+
+	if (str[0] == '\0')
+		return "";
+	len = strlen(str) + 1;
+	memcpy(*strings, str, len);
+	*strings += len;
+	return *strings - len;
+}
+
+static struct graph *graph_build(struct client *c)
+{
+	struct context *ctx = &c->context;
+	struct graph *g;
+	struct graph_port *gp;
+	struct object *o, *l, *p, **listed;
+	uint32_t i, j, n_ports = 0, n_listed = 0, n_peers = 0, hash_size, *peers;
+	uint32_t type_offset[N_PORT_TYPES + 1], n_words;
+	size_t strings = 0, size;
+	char *str;
+
+	spa_list_for_each(o, &ctx->ports, link) {
+		o->port.graph_index = SPA_ID_INVALID;
+		strings += graph_string_size(o->port.name);
+		strings += graph_string_size(o->port.alias1);
+		strings += graph_string_size(o->port.alias2);
+		n_ports++;
+	}
+	for (i = 0; i < N_PORT_TYPES; i++) {
+		type_offset[i] = n_listed;
+		listed = ctx->port_index[i].data;
+		for (j = 0; j < pw_array_get_len(&ctx->port_index[i], struct object *); j++)
+			listed[j]->port.graph_index = n_listed++;
+	}
+	type_offset[N_PORT_TYPES] = n_listed;
+	n_ports = n_listed;
+	spa_list_for_each(o, &ctx->ports, link) {
+		if (o->port.graph_index == SPA_ID_INVALID)
+			o->port.graph_index = n_ports++;
+	}
+	spa_list_for_each(o, &ctx->ports, link) {
+		spa_list_for_each(l, &o->port.src_links, port_link.src_link)
+			n_peers++;
+		spa_list_for_each(l, &o->port.dst_links, port_link.dst_link)
+			n_peers++;
+	}
+
+	hash_size = 16;
+	while (hash_size < n_ports * 2)
+		hash_size <<= 1;
+
+	n_words = (n_listed + 63) / 64;
+
+	size = sizeof(struct graph) +
+		n_ports * sizeof(struct graph_port) +
+		GRAPH_N_FLAGS * n_words * sizeof(uint64_t) +
+		(n_peers + 3 * hash_size) * sizeof(uint32_t) +
+		strings;
+
+	if ((g = calloc(1, size)) == NULL)
+		return NULL;
+
+	g->n_ports = n_ports;
+	g->n_listed = n_listed;
+	memcpy(g->type_offset, type_offset, sizeof(type_offset));
+	g->hash_size = hash_size;
+	g->ports = SPA_MEMBER(g, sizeof(struct graph), struct graph_port);
+	g->n_words = n_words;
+	g->flag_bits = SPA_MEMBER(g->ports, n_ports * sizeof(struct graph_port), uint64_t);
+	peers = (uint32_t *) (g->flag_bits + GRAPH_N_FLAGS * n_words);
+	g->by_name = peers + n_peers;
+	g->by_id = g->by_name + hash_size;
+	g->by_object = g->by_id + hash_size;
+	str = (char *) (g->by_object + hash_size);
+
+	spa_list_for_each(o, &ctx->ports, link) {
+		i = o->port.graph_index;
+		gp = &g->ports[i];
+		gp->object = o;
+		gp->id = o->id;
+		gp->type_id = o->port.type_id;
+		gp->flags = o->port.flags;
+		gp->node_id = o->port.node_id;
+		gp->name_hash = port_name_hash(o->port.name);
+		gp->name = graph_string(&str, o->port.name);
+		gp->alias1 = graph_string(&str, o->port.alias1);
+		gp->alias2 = graph_string(&str, o->port.alias2);
+		gp->peers = peers;
+
+		for (j = 0; i < n_listed && j < GRAPH_N_FLAGS; j++) {
+			if (gp->flags & (1ul << j))
+				g->flag_bits[j * n_words + i / 64] |= (uint64_t)1 << (i % 64);
+		}
+
+		spa_list_for_each(l, &o->port.src_links, port_link.src_link) {
+			p = pw_map_lookup(&ctx->globals, l->port_link.dst);
+			if (p != NULL && p->type == PW_TYPE_INTERFACE_Port &&
+			    p->port.graph_index != SPA_ID_INVALID)
+				gp->peers[gp->n_peers++] = p->port.graph_index;
+		}
+		spa_list_for_each(l, &o->port.dst_links, port_link.dst_link) {
+			p = pw_map_lookup(&ctx->globals, l->port_link.src);
+			if (p != NULL && p->type == PW_TYPE_INTERFACE_Port &&
+			    p->port.graph_index != SPA_ID_INVALID)
+				gp->peers[gp->n_peers++] = p->port.graph_index;
+		}
+		peers += gp->n_peers;
+
+		graph_hash_insert(g, g->by_name, gp->name_hash, i);
+		if (gp->id != SPA_ID_INVALID)
+			graph_hash_insert(g, g->by_id, id_hash(gp->id), i);
+		graph_hash_insert(g, g->by_object, object_ptr_hash(o), i);
+	}
+	return g;
+}
+
+static void graph_reclaim(struct client *c)
+{
+	struct graph *g;
+
+	/* a reader that comes after this check sees the current graph */
+	if (ATOMIC_LOAD(c->context.graph_readers) != 0)
+		return;
+
+	spa_list_consume(g, &c->context.graph_retired, link) {
+		spa_list_remove(&g->link);
+		free(g);
+	}
+	ATOMIC_STORE(c->context.graph_n_retired, 0);
+}
+
+static void graph_retire(struct client *c, struct graph *g)
+{
+	spa_list_append(&c->context.graph_retired, &g->link);
+	ATOMIC_INC(c->context.graph_n_retired);
+}
+
+/* must be called with the thread loop lock */
+static void graph_publish(struct client *c)
+{
+	struct graph *g, *old;
+
+	c->context.graph_wanted = false;
+	if (!c->context.graph_dirty)
+		return;
+
+	if ((g = graph_build(c)) == NULL) {
+		pw_log_warn(NAME" %p: can't build graph: %m", c);
+		return;
+	}
+	ATOMIC_STORE(c->context.graph_dirty, false);
+
+	old = c->context.graph;
+	ATOMIC_STORE(c->context.graph, g);
+
+	pw_log_trace(NAME" %p: publish graph %p with %d ports", c, g, g->n_ports);
+
+	if (old != NULL)
+		graph_retire(c, old);
+	graph_reclaim(c);
+}
+
+/* The graph is only built again when a reader asks for it, so that a
+ * series of changes, like registering many ports, doesn't rebuild it for
+ * each change. */
+static void graph_changed(struct client *c)
+{
+	ATOMIC_STORE(c->context.graph_dirty, true);
+}
+
+static inline struct graph *graph_acquire(struct client *c)
+{
+	if (ATOMIC_LOAD(c->context.graph_dirty)) {
+		if (rt_client != c) {
+			pw_thread_loop_lock(c->context.loop);
+			graph_publish(c);
+			pw_thread_loop_unlock(c->context.loop);
+		} else if (!ATOMIC_XCHG(c->context.graph_wanted, true)) {
+			/* the process thread can't take the lock, it reads the
+			 * previous graph until the protocol loop built a new one */
+			pw_loop_signal_event(pw_thread_loop_get_loop(c->context.loop),
+					c->context.batch_event);
+		}
+	}
+	ATOMIC_INC(c->context.graph_readers);
+	return ATOMIC_LOAD(c->context.graph);
+}
+
+/* the last reader to leave lets the protocol loop free the graphs
+ * that were retired while it was reading */
+static inline void graph_release(struct client *c)
+{
+	if (ATOMIC_DEC(c->context.graph_readers) == 0 &&
+	    ATOMIC_LOAD(c->context.graph_n_retired) > 0 &&
+	    !c->destroyed)
+		pw_loop_signal_event(pw_thread_loop_get_loop(c->context.loop),
+				c->context.batch_event);
+}
+
+static void graph_clear(struct client *c)
+{
+	if (c->context.graph != NULL)
+		graph_retire(c, c->context.graph);
+	c->context.graph = NULL;
+	graph_reclaim(c);
+}
+
+/* must be called with the thread loop lock */
+static struct notification *queue_notify(struct client *c, uint32_t type, int reg)
+{
+	struct notification *n;
+
+	if (pw_array_get_len(&c->notify_pending, struct notification) == 0)
+		pw_loop_signal_event(pw_thread_loop_get_loop(c->context.loop),
+				c->context.batch_event);
+
+	if ((n = pw_array_add(&c->notify_pending, sizeof(struct notification))) == NULL) {
+		pw_log_warn(NAME" %p: can't queue notification: %m", c);
+		return NULL;
+	}
+	spa_zero(*n);
+	n->type = type;
+	n->reg = reg;
+	return n;
+}
+
+/* must be called with the thread loop lock */
+static void object_unref(struct client *c, struct object *o)
+{
+	if (--o->refs == 0 && o->removed) {
+		o->removed = false;
+		spa_list_append(&c->context.free_objects, &o->link);
+	}
+}
+
+/* must be called with the thread loop lock, or after the loop stopped */
+static void free_batch(struct client *c, struct notify_batch *b)
+{
+	struct notification *n;
+
+	pw_array_for_each(n, &b->items) {
+		free(n->old_name);
+		free(n->new_name);
+		if (n->object != NULL)
+			object_unref(c, n->object);
+	}
+	pw_array_clear(&b->items);
+	free(b);
+}
+
+/* hand the pending notifications to the notify thread, after the
+ * graph with the changes was published */
+static void notify_flush(struct client *c)
+{
+	struct notify_batch *b;
+
+	if (pw_array_get_len(&c->notify_pending, struct notification) == 0)
+		return;
+
+	if ((b = calloc(1, sizeof(struct notify_batch))) == NULL) {
+		pw_log_warn(NAME" %p: can't flush notifications: %m", c);
+		return;
+	}
+	b->items = c->notify_pending;
+	pw_array_init(&c->notify_pending, 64 * sizeof(struct notification));
+
+	pthread_mutex_lock(&c->notify_lock);
+	spa_list_append(&c->notify_batches, &b->link);
+	pthread_mutex_unlock(&c->notify_lock);
+
+	pw_loop_signal_event(c->notify_loop, c->notify_event);
+}
+
+static void dispatch_batch(struct client *c, struct notify_batch *b)
+{
+	struct notification *n;
+	bool changed = false;
+
+	pw_log_debug(NAME" %p: dispatch %zd notifications", c,
+			pw_array_get_len(&b->items, struct notification));
+
+	pw_array_for_each(n, &b->items) {
+		switch (n->type) {
+		case NOTIFY_CLIENT_REGISTER:
+			if (c->registration_callback)
+				c->registration_callback(n->name, n->reg, c->registration_arg);
+			break;
+		case NOTIFY_PORT_REGISTER:
+			if (c->portregistration_callback)
+				c->portregistration_callback(n->id, n->reg, c->portregistration_arg);
+			changed = true;
+			break;
+		case NOTIFY_PORT_CONNECT:
+			if (c->connect_callback)
+				c->connect_callback(n->id, n->dst, n->reg, c->connect_arg);
+			changed = true;
+			break;
+		case NOTIFY_PORT_RENAME:
+			if (c->rename_callback)
+				c->rename_callback(n->id, n->old_name, n->new_name, c->rename_arg);
+			break;
+		}
+	}
+	/* one graph order notification for the whole batch */
+	if (changed && c->graph_callback)
+		c->graph_callback(c->graph_arg);
+}
+
+static void on_notify_event(void *data, uint64_t count)
+{
+	struct client *c = data;
+	struct notify_batch *b;
+	struct spa_list batches;
+
+	spa_list_init(&batches);
+
+	pthread_mutex_lock(&c->notify_lock);
+	spa_list_insert_list(&batches, &c->notify_batches);
+	spa_list_init(&c->notify_batches);
+	pthread_mutex_unlock(&c->notify_lock);
+
+	spa_list_consume(b, &batches, link) {
+		spa_list_remove(&b->link);
+		dispatch_batch(c, b);
+
+		pw_thread_loop_lock(c->context.loop);
+		free_batch(c, b);
+		pw_thread_loop_unlock(c->context.loop);
+	}
+}
+
+static void rt_log(struct client *c, uint32_t type, const void *obj, int err,
+		uint64_t val1, uint64_t val2)
+{
+	struct rt_log *log = &c->rt_log;
+	struct rt_log_entry *e;
+	uint32_t index;
+
+	if (spa_ringbuffer_get_write_index(&log->ring, &index) >= RT_LOG_SIZE) {
+		ATOMIC_INC(log->dropped);
+	} else {
+		e = &log->entries[index & RT_LOG_MASK];
+		e->type = type;
+		e->err = err;
+		e->obj = obj;
+		e->val1 = val1;
+		e->val2 = val2;
+		spa_ringbuffer_write_update(&log->ring, index + 1);
+	}
+	if (!ATOMIC_XCHG(log->pending, true))
+		pw_loop_signal_event(c->notify_loop, c->rt_log_event);
+}
+
+static void rt_log_emit(struct client *c, const struct rt_log_entry *e, uint32_t suppressed)
+{
+	switch (e->type) {
+	case RT_LOG_READ_FAILED:
+		pw_log_warn(NAME" %p: read failed %s", c, spa_strerror(-e->err));
+		break;
+	case RT_LOG_MISSED_WAKEUPS:
+		pw_log_warn(NAME" %p: missed %"PRIu64" wakeups", c, e->val1);
+		break;
+	case RT_LOG_OUT_OF_BUFFERS:
+		pw_log_warn("port %p: out of buffers", e->obj);
+		break;
+	case RT_LOG_WRITE_FAILED:
+		pw_log_warn(NAME" %p: write failed to node %"PRIu64": %s", c,
+				e->val1, spa_strerror(-e->err));
+		break;
+	case RT_LOG_MIDI_TIME:
+		pw_log_warn("midi %p: time:%"PRIu64" frames:%"PRIu64, e->obj, e->val1, e->val2);
+		break;
+	case RT_LOG_MIDI_ORDER:
+		pw_log_warn("midi %p: time:%"PRIu64" ev:%"PRIu64, e->obj, e->val1, e->val2);
+		break;
+	case RT_LOG_MIDI_SIZE:
+		pw_log_warn("midi %p: data_size:%"PRIu64, e->obj, e->val1);
+		break;
+	case RT_LOG_MIDI_TOO_LARGE:
+		pw_log_warn("midi %p: event too large: data_size:%"PRIu64, e->obj, e->val1);
+		break;
+	}
+	if (suppressed > 0)
+		pw_log_warn(NAME" %p: %u similar messages suppressed", c, suppressed);
+}
+
+/* runs on the notify thread, or after it stopped with @all to also log the
+ * counts of the current period. Returns the time until the next period of a
+ * type with suppressed messages ends, 0 when there is none. */
+static uint64_t rt_log_flush(struct client *c, bool all)
+{
+	struct rt_log *log = &c->rt_log;
+	struct timespec ts;
+	uint64_t now, next = 0;
+	uint32_t i, index, dropped;
+	int32_t avail;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = SPA_TIMESPEC_TO_NSEC(&ts);
+
+	/* new records after this wake up the notify thread again */
+	ATOMIC_STORE(log->pending, false);
+
+	avail = spa_ringbuffer_get_read_index(&log->ring, &index);
+	for (; avail > 0; avail--, index++) {
+		struct rt_log_entry *e = &log->entries[index & RT_LOG_MASK];
+
+		if (log->last_time[e->type] != 0 &&
+		    now - log->last_time[e->type] < RT_LOG_RATE_NSEC) {
+			log->suppressed[e->type]++;
+			continue;
+		}
+		rt_log_emit(c, e, log->suppressed[e->type]);
+		log->last_time[e->type] = now;
+		log->suppressed[e->type] = 0;
+	}
+	spa_ringbuffer_read_update(&log->ring, index);
+
+	if ((dropped = ATOMIC_XCHG(log->dropped, 0)) > 0)
+		pw_log_warn(NAME" %p: %u realtime messages dropped", c, dropped);
+
+	for (i = 0; i < RT_LOG_N_TYPES; i++) {
+		uint64_t left;
+
+		if (log->suppressed[i] == 0)
+			continue;
+		if (all || now - log->last_time[i] >= RT_LOG_RATE_NSEC) {
+			pw_log_warn(NAME" %p: %u similar messages suppressed", c,
+					log->suppressed[i]);
+			log->last_time[i] = now;
+			log->suppressed[i] = 0;
+			continue;
+		}
+		left = log->last_time[i] + RT_LOG_RATE_NSEC - now;
+		if (next == 0 || left < next)
+			next = left;
+	}
+	return next;
+}
+
+/* runs on the notify thread */
+static void rt_log_arm(struct client *c, uint64_t nsec)
+{
+	struct timespec value;
+
+	if (c->rt_log.armed || c->rt_log_timer == NULL)
+		return;
+
+	value.tv_sec = nsec / SPA_NSEC_PER_SEC;
+	value.tv_nsec = nsec % SPA_NSEC_PER_SEC;
+	pw_loop_update_timer(c->notify_loop, c->rt_log_timer, &value, NULL, false);
+	c->rt_log.armed = true;
+}
+
+static void on_rt_log_event(void *data, uint64_t count)
+{
+	struct client *c = data;
+	rt_log_arm(c, RT_LOG_INTERVAL_MSEC * SPA_NSEC_PER_MSEC);
+}
+
+static void on_rt_log_timeout(void *data, uint64_t expirations)
+{
+	struct client *c = data;
+	uint64_t next;
+
+	c->rt_log.armed = false;
+	if ((next = rt_log_flush(c, false)) > 0)
+		rt_log_arm(c, next);
+}
+
+static void grow_quantum(struct client *c, uint32_t nframes);
+
+/* runs on the protocol loop after a batch of events */
+static void on_batch_event(void *data, uint64_t count)
+{
+	struct client *c = data;
+	uint32_t frames;
+
+	/* the graph runs with a quantum that our buffers can't hold, or
+	 * that the MIDI buffers were not sized for */
+	if ((frames = ATOMIC_LOAD(c->graph_frames)) > c->quantum)
+		grow_quantum(c, frames);
+	if (ATOMIC_LOAD(c->context.graph_wanted))
+		graph_publish(c);
+	graph_reclaim(c);
+	notify_flush(c);
+}
+
+static void free_object(struct client *c, struct object *o)
+{
+	switch (o->type) {
+	case PW_TYPE_INTERFACE_Port:
+		port_name_remove(c, o);
+		port_index_remove(c, o);
+		clear_port_links(c, o);
+		o->port.graph_index = SPA_ID_INVALID;
+		break;
+	case PW_TYPE_INTERFACE_Link:
+		remove_link(c, o);
+		break;
+	}
+        spa_list_remove(&o->link);
+
+	/* the callbacks of the removal still find the object by its id */
+	if (o->refs > 0) {
+		o->removed = true;
+		return;
+	}
+	spa_list_append(&c->context.free_objects, &o->link);
+}
+
+static inline void invalidate_buffer(struct port *p)
+{
+	p->buffer_ptr = NULL;
+}
+
+/* The buffers below are only ever grown from the main or protocol
+ * thread. The old memory stays in the slabs until the client is closed
+ * so that the process thread can keep using it for the current cycle.
+ * The pointer is updated before the size so that the process thread,
+ * which loads the size first, never sees a size that is too large. */
+static int ensure_empty(struct client *c, struct port *p, uint32_t frames)
+{
+	float *empty;
+
+	if (frames <= p->empty_frames)
+		return 0;
+
+	if ((empty = alloc_slab(c, frames + MAX_ALIGN / sizeof(float), sizeof(float))) == NULL)
+		return -errno;
+
+	pw_log_debug(NAME" %p: port %p empty frames %d -> %d", c, p, p->empty_frames, frames);
+
+	p->emptyptr = SPA_PTR_ALIGN(empty, MAX_ALIGN, float);
+	p->zeroed = false;
+	ATOMIC_STORE(p->empty_frames, frames);
+	return 0;
+}
+
+static int ensure_mix_data(struct client *c, struct port *p, uint32_t n_mix)
+{
+	struct midi_cursor *cursors = NULL;
+	void **data;
+	uint32_t max_mix;
+	bool midi = p->object->port.type_id == 1;
+
+	/* the merge heap of MIDI ports always has room for max_mix inputs */
+	if (n_mix <= p->max_mix && (p->mix_cursors != NULL || !midi))
+		return 0;
+
+	max_mix = SPA_MAX(p->max_mix, MIX_CHUNK);
+	while (max_mix < n_mix)
+		max_mix *= 2;
+
+	if ((data = alloc_slab(c, max_mix, sizeof(void *))) == NULL)
+		return -errno;
+	if (midi &&
+	    (cursors = alloc_slab(c, max_mix, sizeof(struct midi_cursor))) == NULL)
+		return -errno;
+
+	p->mix_data = data;
+	p->mix_cursors = cursors;
+	ATOMIC_STORE(p->max_mix, max_mix);
+	return 0;
+}
+
+static struct mix *find_mix(struct client *c, struct port *port, uint32_t mix_id)
+{
+	struct mix *mix;
+
+	spa_list_for_each(mix, &port->mix, port_link) {
+		if (mix->id == mix_id)
+			return mix;
+	}
+	return NULL;
+}
+
+/* The ports, their mixes and the buffers of the mixes are used by the
+ * process thread. Everything it can see is set up first and then linked or
+ * unlinked with a blocking invoke in the data loop. Memory that is no longer
+ * used is only released when the invoke returns.
+ *
+ * The thread loop lock is kept while waiting so that nothing else changes
+ * the ports in the meantime, the process thread must never take it. */
+static inline void rt_invoke(struct client *c, spa_invoke_func_t func,
+		const void *data, size_t size, void *user_data)
+{
+	pw_loop_invoke(c->loop->loop, func, 1, data, size, true, user_data);
+}
+
+static int
+do_add_mix(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct mix *mix = user_data;
+	struct port *port = mix->port;
+
+	spa_list_append(&port->mix, &mix->port_link);
+	port->n_mix++;
+	invalidate_buffer(port);
+	return 0;
+}
+
+static int
+do_remove_mix(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct mix *mix = user_data;
+	struct port *port = mix->port;
+
+	spa_list_remove(&mix->port_link);
+	port->n_mix--;
+	invalidate_buffer(port);
+	return 0;
+}
+
+static int
+do_clear_buffers(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct mix *mix = user_data;
+
+	mix->n_buffers = 0;
+	spa_list_init(&mix->queue);
+	invalidate_buffer(mix->port);
+	return 0;
+}
+
+static void release_buffers(struct client *c, struct mix *mix, uint32_t n_buffers)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < n_buffers; i++) {
+		struct buffer *b = &mix->buffers[i];
+
+		for (j = 0; j < b->n_mem; j++)
+			pw_memmap_free(b->mem[j]);
+
+		b->n_mem = 0;
+	}
+}
+
+static int clear_buffers(struct client *c, struct mix *mix)
+{
+	uint32_t n_buffers = mix->n_buffers;
+
+	pw_log_debug(NAME" %p: port %p clear buffers", c, mix->port);
+
+	rt_invoke(c, do_clear_buffers, NULL, 0, mix);
+	release_buffers(c, mix, n_buffers);
+	return 0;
+}
+
+static struct mix *ensure_mix(struct client *c, struct port *port, uint32_t mix_id)
+{
+	struct mix *mix;
+
+	if ((mix = find_mix(c, port, mix_id)) != NULL)
+		return mix;
+
+	if (ensure_mix_data(c, port, port->n_mix + 1) < 0)
+		return NULL;
+
+	if (spa_list_is_empty(&c->free_mix) &&
+	    grow_mix_pool(c) < 0)
+		return NULL;
+
+	mix = spa_list_first(&c->free_mix, struct mix, link);
+	spa_list_remove(&mix->link);
+
+	mix->id = mix_id;
+	mix->port = port;
+	mix->io = NULL;
+	mix->n_buffers = 0;
+	spa_list_init(&mix->queue);
+
+	rt_invoke(c, do_add_mix, NULL, 0, mix);
+
+	return mix;
+}
+
+static void free_mix(struct client *c, struct mix *mix)
+{
+	rt_invoke(c, do_remove_mix, NULL, 0, mix);
+	release_buffers(c, mix, mix->n_buffers);
+	mix->n_buffers = 0;
+	spa_list_append(&c->free_mix, &mix->link);
+}
+
+static int
+do_add_port(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct port *p = user_data;
+	spa_list_append(&p->client->ports[p->direction], &p->link);
+	if (p->direction == SPA_DIRECTION_OUTPUT && p->object->port.type_id == 1)
+		spa_list_append(&p->client->midi_outputs, &p->midi_link);
+	return 0;
+}
+
+static int
+do_remove_port(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct port *p = user_data;
+	spa_list_remove(&p->link);
+	if (p->direction == SPA_DIRECTION_OUTPUT && p->object->port.type_id == 1)
+		spa_list_remove(&p->midi_link);
+	return 0;
+}
+
+static uint32_t midi_buffer_size(struct client *c, uint32_t size_hint)
+{
+	uint32_t size = c->midi_buffer_size ? c->midi_buffer_size : c->quantum * sizeof(float);
+	return SPA_MAX(SPA_MAX(size, size_hint), MIN_MIDI_BUFFER_SIZE);
+}
+
+static struct port * alloc_port(struct client *c, enum spa_direction direction,
+		jack_port_type_id_t type_id, uint32_t size_hint)
+{
+	struct port *p;
+	struct object *o;
+	uint32_t frames = c->max_frames, midi_size = 0;
+
+	if (spa_list_is_empty(&c->free_ports[direction]) &&
+	    grow_port_pool(c, direction) < 0)
+		return NULL;
+
+	p = spa_list_first(&c->free_ports[direction], struct port, link);
+
+	/* the port buffer of MIDI ports only holds the events */
+	if (type_id == 1) {
+		midi_size = midi_buffer_size(c, size_hint);
+		frames = midi_size / sizeof(float);
+	}
+	if (ensure_empty(c, p, frames) < 0)
+		return NULL;
+
+	spa_list_remove(&p->link);
+
+	o = alloc_object(c);
+	o->type = PW_TYPE_INTERFACE_Port;
+	o->id = SPA_ID_INVALID;
+	o->port.node_id = c->node_id;
+	o->port.port_id = p->id;
+	o->port.port = p;
+	o->port.type_id = type_id;
+	init_port_links(o);
+	spa_list_append(&c->context.ports, &o->link);
+
+	p->valid = true;
+	p->zeroed = false;
+	p->buffer_ptr = NULL;
+	p->client = c;
+	p->object = o;
+	spa_list_init(&p->mix);
+	p->n_mix = 0;
+	p->size_hint = size_hint;
+	p->midi_size = midi_size;
+	/* a pooled port might have a heap of a smaller max_mix */
+	p->mix_cursors = NULL;
+	spa_zero(p->midi_stats);
+
+	rt_invoke(c, do_add_port, NULL, 0, p);
+
+	return p;
+}
+
+static void free_port(struct client *c, struct port *p)
+{
+	struct mix *m, *t;
+
+	if (!p->valid)
+		return;
+
+	rt_invoke(c, do_remove_port, NULL, 0, p);
+
+	if (p->midi_stats.lost_events > 0)
+		pw_log_info(NAME" %p: port %p lost %"PRIu64" of %"PRIu64" MIDI events, "
+				"at most %u bytes of %u used", c, p,
+				p->midi_stats.lost_events, p->midi_stats.events,
+				p->midi_stats.max_used, p->midi_size);
+
+	spa_list_for_each_safe(m, t, &p->mix, port_link)
+		free_mix(c, m);
+
+	p->valid = false;
+	free_object(c, p->object);
+	spa_list_append(&c->free_ports[p->direction], &p->link);
+}
+
+static struct object *find_port(struct client *c, const char *name)
+{
+	struct object *o;
+	uint32_t hash = port_name_hash(name);
+
+	object_hash_for_each(o, &c->context.port_names, hash) {
+		if (o->hash == hash && !strcmp(o->port.name, name))
+			return o;
+	}
+	return NULL;
+}
+
+static struct object *find_link(struct client *c, uint32_t src, uint32_t dst)
+{
+	struct object *l;
+	uint32_t hash = link_ports_hash(src, dst);
+
+	object_hash_for_each(l, &c->context.link_ports, hash) {
+		if (l->port_link.src == src &&
+		    l->port_link.dst == dst) {
+			return l;
+		}
+	}
+	return NULL;
+}
+
+static struct buffer *dequeue_buffer(struct mix *mix)
+{
+        struct buffer *b;
+
+        if (spa_list_is_empty(&mix->queue))
+                return NULL;
+
+        b = spa_list_first(&mix->queue, struct buffer, link);
+        spa_list_remove(&b->link);
+	SPA_FLAG_SET(b->flags, BUFFER_FLAG_OUT);
+
+        return b;
+}
+
+SPA_EXPORT
+void jack_get_version(int *major_ptr, int *minor_ptr, int *micro_ptr, int *proto_ptr)
+{
+	*major_ptr = 0;
+	*minor_ptr = 0;
+	*micro_ptr = 0;
+	*proto_ptr = 0;
+}
+
+SPA_EXPORT
+const char *
+jack_get_version_string(void)
+{
+	return "0.0.0.0";
+}
+
+static void on_state_changed(void *data, enum pw_remote_state old,
+                             enum pw_remote_state state, const char *error)
+{
+	struct client *client = data;
+
+	pw_log_debug(NAME" %p: state %s", client, pw_remote_state_as_string(state));
 	switch (state) {
 	case PW_REMOTE_STATE_ERROR:
 		client->error = true;
@@ -578,6 +2063,7 @@ static int do_sync(struct client *client)
 		if (client->last_sync == seq)
 			break;
 	}
+	notify_flush(client);
 	return 0;
 }
 
@@ -595,17 +2081,106 @@ static const struct pw_proxy_events proxy_events = {
 	.destroy = on_node_proxy_destroy,
 };
 
+/* position of the first link with a node_id >= node_id */
+static uint32_t link_index(struct pw_array *links, uint32_t node_id)
+{
+	struct link *l = links->data;
+	uint32_t lo = 0, hi = pw_array_get_len(links, struct link);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (l[mid].node_id < node_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 static struct link *find_activation(struct pw_array *links, uint32_t node_id)
 {
-	struct link *l;
+	uint32_t idx = link_index(links, node_id);
 
-	pw_array_for_each(l, links) {
+	if (idx < pw_array_get_len(links, struct link)) {
+		struct link *l = pw_array_get_unchecked(links, idx, struct link);
 		if (l->node_id == node_id)
 			return l;
 	}
 	return NULL;
 }
 
+static void remove_activation(struct pw_array *links, struct link *l)
+{
+	memmove(l, l + 1, SPA_PTRDIFF(pw_array_end(links), l + 1));
+	links->size -= sizeof(struct link);
+}
+
+static inline size_t signal_table_size(uint32_t n_links)
+{
+	return sizeof(struct signal_table) +
+		n_links * (sizeof(struct pw_node_activation_state *) +
+			   sizeof(struct pw_node_activation *) +
+			   sizeof(int) + sizeof(uint32_t));
+}
+
+static struct signal_table *signal_table_new(struct pw_array *links)
+{
+	struct signal_table *t;
+	struct link *l;
+	uint32_t i, n_links = pw_array_get_len(links, struct link);
+	void *p;
+
+	t = calloc(1, signal_table_size(n_links));
+	if (t == NULL)
+		return NULL;
+
+	p = SPA_MEMBER(t, sizeof(struct signal_table), void);
+	t->state = p;
+	t->activation = (struct pw_node_activation **) &t->state[n_links];
+	t->signalfd = (int *) &t->activation[n_links];
+	t->node_id = (uint32_t *) &t->signalfd[n_links];
+
+	i = 0;
+	pw_array_for_each(l, links) {
+		t->state[i] = &l->activation->state[0];
+		t->activation[i] = l->activation;
+		t->signalfd[i] = l->signalfd;
+		t->node_id[i] = l->node_id;
+		i++;
+	}
+	t->n_links = i;
+	return t;
+}
+
+static int
+do_swap_signals(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct client *c = user_data;
+	struct signal_table **t = (struct signal_table **) data;
+	struct signal_table *old = c->signals;
+
+	c->signals = *t;
+	*t = old;
+	return 0;
+}
+
+/* when this returns, the RT thread no longer uses the previous table or the
+ * activations that were removed from the links */
+static int update_signals(struct client *c)
+{
+	struct signal_table *t;
+
+	if ((t = signal_table_new(&c->links)) == NULL)
+		return -errno;
+	if (c->lock_memory)
+		lock_memory(c, t, signal_table_size(t->n_links));
+
+	rt_invoke(c, do_swap_signals, &t, sizeof(t), c);
+	free(t);
+	return 0;
+}
+
 static int
 do_remove_sources(struct spa_loop *loop,
                   bool async, uint32_t seq, const void *data, size_t size, void *user_data)
@@ -659,49 +2234,227 @@ static void convert_from_midi(void *midi, void *buffer, size_t size)
         spa_pod_builder_pop(&b, &f);
 }
 
-static void convert_to_midi(struct spa_pod_sequence **seq, uint32_t n_seq, void *midi)
+static inline void control_to_midi(struct spa_pod_control *c, void *midi)
 {
-	struct spa_pod_control *c[n_seq];
-	uint32_t i;
-
-	for (i = 0; i < n_seq; i++) {
-		c[i] = spa_pod_control_first(&seq[i]->body);
+	switch(c->type) {
+	case SPA_CONTROL_Midi:
+		jack_midi_event_write(midi,
+				c->offset,
+				SPA_POD_BODY(&c->value),
+				SPA_POD_BODY_SIZE(&c->value));
+		break;
 	}
+}
+
+static inline bool midi_cursor_valid(const struct midi_cursor *m)
+{
+	return spa_pod_control_is_inside(&m->seq->body, SPA_POD_BODY_SIZE(m->seq), m->c);
+}
+
+/* earlier offset first, on the same offset the lowest input first */
+static inline bool midi_cursor_before(const struct midi_cursor *a, const struct midi_cursor *b)
+{
+	return a->c->offset < b->c->offset ||
+		(a->c->offset == b->c->offset && a->index < b->index);
+}
+
+static void midi_heap_down(struct midi_cursor *heap, uint32_t n_heap, uint32_t i)
+{
+	struct midi_cursor tmp = heap[i];
 
 	while (true) {
-		struct spa_pod_control *next = NULL;
-		uint32_t next_index = 0;
+		uint32_t child = 2 * i + 1;
 
-		for (i = 0; i < n_seq; i++) {
-			if (!spa_pod_control_is_inside(&seq[i]->body,
-						SPA_POD_BODY_SIZE(seq[i]), c[i]))
-				continue;
+		if (child >= n_heap)
+			break;
+		if (child + 1 < n_heap && midi_cursor_before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!midi_cursor_before(&heap[child], &tmp))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = tmp;
+}
 
-			if (next == NULL || c[i]->offset < next->offset) {
-				next = c[i];
-				next_index = i;
-			}
+/* Merge the sequences on offset. The order is the same as repeatedly taking
+ * the event with the lowest offset of all the inputs, with ties going to the
+ * input that comes first. */
+static void convert_to_midi(struct spa_pod_sequence **seq, uint32_t n_seq,
+		struct midi_cursor *heap, void *midi)
+{
+	struct midi_cursor *top;
+	uint32_t i, n_heap = 0;
+
+	if (n_seq == 0)
+		return;
+
+	for (i = 0; i < n_seq; i++) {
+		struct midi_cursor *m = &heap[n_heap];
+
+		m->seq = seq[i];
+		m->c = spa_pod_control_first(&seq[i]->body);
+		m->index = i;
+		if (midi_cursor_valid(m))
+			n_heap++;
+	}
+
+	if (n_heap == 2) {
+		struct midi_cursor *a = &heap[0], *b = &heap[1];
+
+		while (true) {
+			top = midi_cursor_before(b, a) ? b : a;
+			control_to_midi(top->c, midi);
+			top->c = spa_pod_control_next(top->c);
+			if (!midi_cursor_valid(top))
+				break;
 		}
-		if (next == NULL)
-			break;
+		/* copy the rest of the other one */
+		heap[0] = top == a ? *b : *a;
+		n_heap = 1;
+	}
+	if (n_heap == 1) {
+		top = &heap[0];
+		do {
+			control_to_midi(top->c, midi);
+			top->c = spa_pod_control_next(top->c);
+		} while (midi_cursor_valid(top));
+		return;
+	}
 
-		switch(next->type) {
-		case SPA_CONTROL_Midi:
-			jack_midi_event_write(midi,
-					next->offset,
-					SPA_POD_BODY(&next->value),
-					SPA_POD_BODY_SIZE(&next->value));
-			break;
+	for (i = n_heap / 2; i-- > 0;)
+		midi_heap_down(heap, n_heap, i);
+
+	while (n_heap > 0) {
+		top = &heap[0];
+		control_to_midi(top->c, midi);
+		top->c = spa_pod_control_next(top->c);
+		if (!midi_cursor_valid(top))
+			heap[0] = heap[--n_heap];
+		midi_heap_down(heap, n_heap, 0);
+	}
+}
+
+
+static void midi_view_init(void *midi, struct spa_pod_sequence *seq)
+{
+	struct midi_view *v = midi;
+
+	v->mb.magic = MIDI_VIEW_MAGIC;
+	v->mb.write_pos = 0;
+	v->mb.event_count = 0;
+	v->mb.lost_events = 0;
+	v->seq = seq;
+	v->maxsize = 0;
+	v->indexed = false;
+}
+
+static inline uint32_t midi_view_max_index(struct midi_view *v)
+{
+	return v->mb.buffer_size > (int32_t)sizeof(struct midi_view) ?
+		(v->mb.buffer_size - sizeof(struct midi_view)) / sizeof(uint32_t) : 0;
+}
+
+static inline void midi_encode_clear(struct midi_view *v)
+{
+	v->seq->pod.type = SPA_TYPE_Sequence;
+	v->seq->pod.size = sizeof(struct spa_pod_sequence_body);
+	v->seq->body.unit = 0;
+	v->seq->body.pad = 0;
+	v->mb.event_count = 0;
+	v->mb.lost_events = 0;
+}
+
+static void midi_encode_init(void *midi, void *data, uint32_t maxsize)
+{
+	struct midi_view *v = midi;
+
+	v->mb.magic = MIDI_VIEW_MAGIC;
+	v->mb.write_pos = 0;
+	v->seq = data;
+	v->maxsize = maxsize;
+	v->indexed = true;
+	midi_encode_clear(v);
+}
+
+/* the outgoing buffer was handed to the peers, the port buffer is a
+ * regular one again until the next cycle */
+static inline void midi_encode_done(struct midi_view *v)
+{
+	v->mb.magic = MIDI_BUFFER_MAGIC;
+	v->mb.write_pos = 0;
+	v->mb.event_count = 0;
+}
+
+static inline size_t midi_encode_max_size(struct midi_view *v)
+{
+	size_t used = SPA_POD_SIZE(&v->seq->pod) + sizeof(struct spa_pod_control);
+
+	if (v->mb.event_count >= midi_view_max_index(v) || used >= v->maxsize)
+		return 0;
+	/* the control is padded to 8 bytes */
+	return (v->maxsize - used) & ~(size_t)7;
+}
+
+/* turn the view into a regular buffer, for when it is written to or the
+ * index does not fit */
+static void midi_view_convert(struct midi_view *v)
+{
+	struct spa_pod_sequence *seq = v->seq;
+	struct midi_cursor cursor;
+
+	jack_midi_clear_buffer(v);
+	convert_to_midi(&seq, 1, &cursor, v);
+}
+
+/* Index the events the same way jack_midi_event_write() would accept
+ * them. Returns false when the index does not fit and the view was
+ * converted instead. */
+static bool midi_view_index(struct midi_view *v)
+{
+	struct spa_pod_sequence *seq = v->seq;
+	struct spa_pod_control *c;
+	uint32_t n_index = 0, max_index, last = 0;
+
+	if (v->indexed)
+		return true;
+
+	max_index = midi_view_max_index(v);
+
+	SPA_POD_SEQUENCE_FOREACH(seq, c) {
+		if (c->type != SPA_CONTROL_Midi)
+			continue;
+		if (c->offset >= v->mb.nframes ||
+		    (n_index > 0 && c->offset < last) ||
+		    SPA_POD_BODY_SIZE(&c->value) == 0) {
+			v->mb.lost_events++;
+			continue;
 		}
-		c[next_index] = spa_pod_control_next(c[next_index]);
+		if (n_index == max_index) {
+			midi_view_convert(v);
+			return false;
+		}
+		v->index[n_index++] = SPA_PTRDIFF(c, seq);
+		last = c->offset;
 	}
+	v->mb.event_count = n_index;
+	v->indexed = true;
+	return true;
 }
 
+static inline struct midi_view *midi_get_view(void *port_buffer)
+{
+	struct midi_view *v = port_buffer;
+
+	if (v->mb.magic != MIDI_VIEW_MAGIC || !midi_view_index(v))
+		return NULL;
+	return v;
+}
 
-static void *get_buffer_output(struct client *c, struct port *p, uint32_t frames, uint32_t stride)
+static struct spa_data *get_buffer_output(struct client *c, struct port *p, uint32_t frames, uint32_t stride)
 {
 	struct mix *mix;
-	void *ptr = NULL;
+	struct spa_data *d = NULL;
 
 	p->io.status = -EPIPE;
 	p->io.buffer_id = SPA_ID_INVALID;
@@ -716,15 +2469,15 @@ static void *get_buffer_output(struct client *c, struct port *p, uint32_t frames
 				c, p, p->id, frames, mix->n_buffers);
 
 		if ((b = dequeue_buffer(mix)) == NULL) {
-			pw_log_warn("port %p: out of buffers", p);
+			rt_log(c, RT_LOG_OUT_OF_BUFFERS, p, 0, 0, 0);
 			goto done;
 		}
 		reuse_buffer(c, mix, b->id);
-		ptr = b->datas[0].data;
+		d = &b->datas[0];
 
-		b->datas[0].chunk->offset = 0;
-		b->datas[0].chunk->size = frames * sizeof(float);
-		b->datas[0].chunk->stride = stride;
+		d->chunk->offset = 0;
+		d->chunk->size = SPA_MIN(frames * sizeof(float), d->maxsize);
+		d->chunk->stride = stride;
 
 		p->io.status = SPA_STATUS_HAVE_DATA;
 		p->io.buffer_id = b->id;
@@ -738,19 +2491,69 @@ done:
 				c, p, p->id, mix->id, frames, mio);
 		*mio = p->io;
 	}
-	return ptr;
+	return d;
+}
+
+/* add the events of the past cycle to the totals */
+static void midi_account(struct port *p, void *midi)
+{
+	struct midi_buffer *mb = midi;
+	struct midi_view *v = midi;
+	jack_midi_port_stats_t *s = &p->midi_stats;
+	uint32_t used;
+
+	if (mb->magic == MIDI_VIEW_MAGIC) {
+		/* nobody looked at the events */
+		if (!v->indexed)
+			return;
+		if (v->maxsize > 0)
+			used = SPA_POD_SIZE(&v->seq->pod);
+		else
+			used = sizeof(struct midi_view) + mb->event_count * sizeof(uint32_t);
+	} else {
+		used = sizeof(struct midi_buffer) + mb->write_pos +
+			mb->event_count * sizeof(struct midi_event);
+	}
+	s->events += mb->event_count;
+	s->lost_events += mb->lost_events;
+	s->max_events = SPA_MAX(s->max_events, mb->event_count);
+	s->max_used = SPA_MAX(s->max_used, used);
 }
 
+static inline bool port_has_peers(struct port *p)
+{
+	struct mix *mix;
+
+	spa_list_for_each(mix, &p->mix, port_link) {
+		if (mix->id != SPA_ID_INVALID && mix->io != NULL)
+			return true;
+	}
+	return false;
+}
+
+/* The events of the MIDI outputs that were asked for in this cycle are
+ * already encoded in the outgoing buffer. The others only need a buffer
+ * when there is someone to send it to. */
 static void process_tee(struct client *c)
 {
 	struct port *p;
 
-	spa_list_for_each(p, &c->ports[SPA_DIRECTION_OUTPUT], link) {
-		if (p->object->port.type_id != 1)
+	spa_list_for_each(p, &c->midi_outputs, midi_link) {
+		struct midi_view *v = (struct midi_view *) p->emptyptr;
+		struct spa_data *d;
+
+		if (p->buffer_cycle == c->cycle)
+			midi_account(p, v);
+
+		if (v->mb.magic == MIDI_VIEW_MAGIC) {
+			midi_encode_done(v);
+			if (p->buffer_cycle == c->cycle)
+				continue;
+		}
+		if (!port_has_peers(p))
 			continue;
-		void *ptr = get_buffer_output(c, p, MAX_BUFFER_FRAMES, 1);
-		if (ptr != NULL)
-			convert_from_midi(p->emptyptr, ptr, MAX_BUFFER_FRAMES * sizeof(float));
+		if ((d = get_buffer_output(c, p, ATOMIC_LOAD(p->midi_size) / sizeof(float), 1)) != NULL)
+			convert_from_midi(p->emptyptr, d->data, d->chunk->size);
 	}
 }
 
@@ -847,54 +2650,386 @@ static inline jack_transport_state_t position_to_jack(struct pw_node_activation
 	else
 		d->frame = seg->position;
 
-	d->valid = 0;
-	if (a->segment_owner[0] && SPA_FLAG_IS_SET(seg->bar.flags, SPA_IO_SEGMENT_BAR_FLAG_VALID)) {
-		double abs_beat;
-		long beats;
+	d->valid = 0;
+	if (a->segment_owner[0] && SPA_FLAG_IS_SET(seg->bar.flags, SPA_IO_SEGMENT_BAR_FLAG_VALID)) {
+		double abs_beat;
+		long beats;
+
+		d->valid |= JackPositionBBT;
+
+		d->bbt_offset = seg->bar.offset;
+		if (seg->bar.offset)
+			d->valid |= JackBBTFrameOffset;
+
+		d->beats_per_bar = seg->bar.signature_num;
+		d->beat_type = seg->bar.signature_denom;
+		d->ticks_per_beat = 1920.0f;
+		d->beats_per_minute = seg->bar.bpm;
+
+		abs_beat = seg->bar.beat;
+
+		d->bar = abs_beat / d->beats_per_bar;
+		beats = d->bar * d->beats_per_bar;
+		d->bar_start_tick = beats * d->ticks_per_beat;
+		d->beat = abs_beat - beats;
+		beats += d->beat;
+		d->tick = (abs_beat - beats) * d->ticks_per_beat;
+		d->bar++;
+		d->beat++;
+	}
+	d->unique_2 = d->unique_1;
+	return state;
+}
+
+static const char *get_config(struct client *c, const char *key, const char *env)
+{
+	const char *str;
+	if ((str = getenv(env)) != NULL)
+		return str;
+	return pw_properties_get(c->props, key);
+}
+
+static inline bool is_rt_policy(int policy)
+{
+	policy &= ~SCHED_RESET_ON_FORK;
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static int get_rt_priority(pthread_t thread)
+{
+	struct sched_param sp;
+	int policy;
+
+	if (pthread_getschedparam(thread, &policy, &sp) != 0 ||
+	    !is_rt_policy(policy))
+		return -1;
+	return sp.sched_priority;
+}
+
+/* Without CAP_SYS_NICE we can still get a priority up to RLIMIT_RTPRIO, use
+ * that when the requested one is denied. */
+static int set_rt_scheduling(pthread_t thread, int policy, int priority)
+{
+	struct sched_param sp;
+	struct rlimit rl;
+	int res, min, max;
+
+	min = sched_get_priority_min(policy);
+	max = sched_get_priority_max(policy);
+
+	spa_zero(sp);
+	sp.sched_priority = SPA_CLAMP(priority, min, max);
+
+	if ((res = pthread_setschedparam(thread, policy, &sp)) == 0)
+		goto done;
+
+	if (res != EPERM ||
+	    getrlimit(RLIMIT_RTPRIO, &rl) < 0 ||
+	    rl.rlim_cur < (rlim_t) min ||
+	    rl.rlim_cur >= (rlim_t) sp.sched_priority)
+		return -res;
+
+	pw_log_info("thread %lu: priority %d denied, using RLIMIT_RTPRIO %d",
+			thread, sp.sched_priority, (int) rl.rlim_cur);
+
+	sp.sched_priority = rl.rlim_cur;
+	if ((res = pthread_setschedparam(thread, policy, &sp)) != 0)
+		return -res;
+done:
+	pw_log_debug("thread %lu: policy %d priority %d", thread, policy, sp.sched_priority);
+	return 0;
+}
+
+static int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+	char *end;
+	long first, last;
+
+	CPU_ZERO(set);
+	while (*str) {
+		first = last = strtol(str, &end, 10);
+		if (end == str)
+			return -EINVAL;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str)
+				return -EINVAL;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str != '\0')
+			return -EINVAL;
+	}
+	return CPU_COUNT(set);
+}
+
+/* The other threads get the CPUs of the process without the realtime ones,
+ * so that they stay away from the realtime threads. */
+static void init_cpu_placement(struct client *c, const char *str)
+{
+	cpu_set_t all;
+
+	if (parse_cpu_list(str, &c->rt_cpus) <= 0) {
+		pw_log_warn(NAME" %p: invalid rt cpus '%s'", c, str);
+		return;
+	}
+	if (sched_getaffinity(0, sizeof(all), &all) < 0)
+		CPU_ZERO(&all);
+
+	CPU_XOR(&c->other_cpus, &all, &c->rt_cpus);
+	CPU_AND(&c->other_cpus, &c->other_cpus, &all);
+	if (CPU_COUNT(&c->other_cpus) == 0) {
+		pw_log_warn(NAME" %p: no cpus left for other threads", c);
+		c->other_cpus = all;
+	}
+	c->have_rt_cpus = true;
+	pw_log_info(NAME" %p: %d rt cpus, %d other cpus", c,
+			CPU_COUNT(&c->rt_cpus), CPU_COUNT(&c->other_cpus));
+}
+
+static int set_affinity(pthread_t thread, const cpu_set_t *set)
+{
+	int res;
+
+	if ((res = pthread_setaffinity_np(thread, sizeof(cpu_set_t), set)) != 0) {
+		pw_log_warn("thread %lu: can't set affinity: %s", thread, strerror(res));
+		return -res;
+	}
+	return 0;
+}
+
+/* called in the protocol and notify threads */
+static int
+do_set_other_affinity(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct client *c = user_data;
+	return set_affinity(pthread_self(), &c->other_cpus);
+}
+
+/* the priority of the thread that runs the process callback */
+static int client_rt_priority(struct client *c)
+{
+	/* a deadline task has no priority but runs before all FIFO
+	 * threads, use the one we would fall back to */
+	if (c->deadline_active)
+		return c->rt_priority;
+	if (c->loop->running)
+		return get_rt_priority(c->loop->thread);
+	return c->rt_priority;
+}
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE		6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK	0x01
+#endif
+
+/* not in all C libraries yet */
+struct deadline_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+/* When the kernel does not admit the new parameters we go back to FIFO,
+ * keeping the old reservation would throttle us when the period got
+ * shorter. The next change of the period tries again. */
+static void update_deadline(struct client *c, uint64_t period)
+{
+	struct deadline_attr attr;
+	int res;
+
+	spa_zero(attr);
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+	attr.sched_runtime = period * c->deadline_percent / 100;
+	attr.sched_deadline = period;
+	attr.sched_period = period;
+
+#ifdef SYS_sched_setattr
+	res = syscall(SYS_sched_setattr, c->data_tid, &attr, 0) < 0 ? -errno : 0;
+#else
+	res = -ENOSYS;
+#endif
+	if (res == 0) {
+		pw_log_info(NAME" %p: deadline runtime:%"PRIu64" period:%"PRIu64, c,
+				attr.sched_runtime, attr.sched_period);
+		c->deadline_active = true;
+		return;
+	}
+
+	pw_log_warn(NAME" %p: deadline runtime:%"PRIu64" period:%"PRIu64" refused: %s, "
+			"falling back to FIFO", c, attr.sched_runtime, attr.sched_period,
+			spa_strerror(res));
+
+	c->deadline_active = false;
+	if ((res = set_rt_scheduling(c->loop->thread, SCHED_FIFO, c->rt_priority)) < 0)
+		pw_log_warn(NAME" %p: can't set FIFO: %s", c, spa_strerror(res));
+}
+
+/* follow the quantum and the rate that the data thread saw last */
+static void check_deadline(struct client *c)
+{
+	uint32_t frames = ATOMIC_LOAD(c->buffer_frames);
+	uint32_t rate = ATOMIC_LOAD(c->sample_rate);
+	uint64_t period;
+
+	if (!c->loop->running || c->data_tid == 0 ||
+	    frames == 0 || frames == (uint32_t)-1 || rate == 0)
+		return;
+
+	period = frames * SPA_NSEC_PER_SEC / rate;
+	if (period == c->deadline_period)
+		return;
+
+	c->deadline_period = period;
+	update_deadline(c, period);
+}
+
+static void on_deadline_event(void *data, uint64_t count)
+{
+	struct client *c = data;
+	check_deadline(c);
+}
+
+/* Make denormal floats zero in the calling thread, they are very slow to
+ * compute with and only appear when signals decay to silence. The mix
+ * functions only add, they give the same results for normal values. */
+static void flush_denormals(void)
+{
+#if defined(__SSE__)
+	/* FTZ and DAZ */
+	__builtin_ia32_ldmxcsr(__builtin_ia32_stmxcsr() | 0x8040);
+#elif defined(__aarch64__)
+	uint64_t fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+	/* FZ */
+	__asm__ __volatile__("msr fpcr, %0" :: "r"(fpcr | (1 << 24)));
+#endif
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* While we spin, the SPINNING flag is set on our FINISHED or NOT_TRIGGERED
+ * activation status. A peer that triggers us and sees the flag swaps the
+ * status to a plain TRIGGERED and skips the eventfd write. The server and
+ * older clients store TRIGGERED and write the eventfd, possibly after we
+ * already saw the status and ran the cycle. When spinning, such a late write
+ * is recognized in cycle_wakeup() because our status is no longer TRIGGERED.
+ *
+ * The flag is only ever set on a status of a node that is not triggered,
+ * which the driver does not check, a triggered or running node always has
+ * the plain TRIGGERED or AWAKE status that the xrun checks look for. */
+#define STATUS_SPINNING		(1u<<30)
 
-		d->valid |= JackPositionBBT;
+/* Poll our activation until a peer or the driver triggers us. Only a
+ * FINISHED or NOT_TRIGGERED status is for the cycle that is coming next,
+ * anything else and we go back to the eventfd. Returns true when we were
+ * triggered. */
+static inline bool cycle_spin(struct client *c)
+{
+	struct pw_node_activation *activation = c->activation;
+	struct timespec ts;
+	uint64_t end;
+	uint32_t status, count = 0;
 
-		d->bbt_offset = seg->bar.offset;
-		if (seg->bar.offset)
-			d->valid |= JackBBTFrameOffset;
+	if (c->spin_nsec == 0 || activation == NULL)
+		return false;
 
-		d->beats_per_bar = seg->bar.signature_num;
-		d->beat_type = seg->bar.signature_denom;
-		d->ticks_per_beat = 1920.0f;
-		d->beats_per_minute = seg->bar.bpm;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	end = SPA_TIMESPEC_TO_NSEC(&ts) + c->spin_nsec;
 
-		abs_beat = seg->bar.beat;
+	while (true) {
+		status = ATOMIC_LOAD(activation->status);
+
+		if (status & STATUS_SPINNING) {
+			if (++count == SPIN_CHECK_INTERVAL) {
+				count = 0;
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				if (SPA_TIMESPEC_TO_NSEC(&ts) >= end &&
+				    ATOMIC_CAS(activation->status, status, status & ~STATUS_SPINNING)) {
+					c->spin_fallbacks++;
+					return false;
+				}
+			}
+			cpu_relax();
+			continue;
+		}
+		switch (status) {
+		case PW_NODE_ACTIVATION_FINISHED:
+		case PW_NODE_ACTIVATION_NOT_TRIGGERED:
+			ATOMIC_CAS(activation->status, status, status | STATUS_SPINNING);
+			break;
+		case PW_NODE_ACTIVATION_TRIGGERED:
+			c->spin_hits++;
+			return true;
+		default:
+			return false;
+		}
+	}
+}
 
-		d->bar = abs_beat / d->beats_per_bar;
-		beats = d->bar * d->beats_per_bar;
-		d->bar_start_tick = beats * d->ticks_per_beat;
-		d->beat = abs_beat - beats;
-		beats += d->beat;
-		d->tick = (abs_beat - beats) * d->ticks_per_beat;
-		d->bar++;
-		d->beat++;
+/* Consume the eventfd after the loop woke up. Returns false when there is
+ * no cycle to run: nothing was written, or we spin and the write was for a
+ * cycle that we already ran after seeing the status. Without spinning every
+ * write runs a cycle, also when the driver triggered us again while we were
+ * still busy and our late signal_sync() already replaced the status. */
+static inline bool cycle_wakeup(struct client *c)
+{
+	uint64_t cmd;
+	int fd = c->socket_source->fd;
+
+	if (read(fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+		if (errno != EWOULDBLOCK)
+			rt_log(c, RT_LOG_READ_FAILED, c, errno, 0, 0);
+		return false;
 	}
-	d->unique_2 = d->unique_1;
-	return state;
+	if (c->spin_nsec != 0 &&
+	    ATOMIC_LOAD(c->activation->status) != PW_NODE_ACTIVATION_TRIGGERED)
+		return false;
+
+	/* with spinning a late write adds to the count of the next one */
+	if (cmd > 1 && c->spin_nsec == 0)
+		rt_log(c, RT_LOG_MISSED_WAKEUPS, c, 0, cmd - 1, 0);
+	return true;
 }
 
 static inline uint32_t cycle_run(struct client *c)
 {
-	uint64_t cmd, nsec;
-	int fd = c->socket_source->fd;
+	uint64_t nsec;
 	uint32_t buffer_frames, sample_rate;
+	bool changed = false;
 	struct spa_io_position *pos = c->position;
 	struct pw_node_activation *activation = c->activation;
 	struct pw_node_activation *driver = c->driver_activation;
 
-	/* this is blocking if nothing ready */
-	if (read(fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
-		pw_log_warn(NAME" %p: read failed %m", c);
-		if (errno == EWOULDBLOCK)
-			return 0;
-	}
-	if (cmd > 1)
-		pw_log_warn(NAME" %p: missed %"PRIu64" wakeups", c, cmd - 1);
+	rt_client = c;
+
+	/* invalidates the buffers of the previous cycle */
+	c->cycle++;
 
 	if (pos == NULL) {
 		pw_log_error(NAME" %p: missing position", c);
@@ -905,26 +3040,39 @@ static inline uint32_t cycle_run(struct client *c)
 	activation->status = PW_NODE_ACTIVATION_AWAKE;
 	activation->awake_time = nsec;
 	if (c->first) {
+		if (c->flush_denormals)
+			flush_denormals();
 		if (c->thread_init_callback)
 			c->thread_init_callback(c->thread_init_arg);
 		c->first = false;
 	}
 
+	/* the notify thread reads them for the deadline period */
 	buffer_frames = pos->clock.duration;
 	if (buffer_frames != c->buffer_frames) {
 		pw_log_info(NAME" %p: bufferframes %d", c, buffer_frames);
-		c->buffer_frames = buffer_frames;
+		ATOMIC_STORE(c->buffer_frames, buffer_frames);
+		changed = true;
 		if (c->bufsize_callback)
 			c->bufsize_callback(c->buffer_frames, c->bufsize_arg);
 	}
+	if (buffer_frames > ATOMIC_LOAD(c->graph_frames)) {
+		/* the protocol loop renegotiates the buffers when needed */
+		ATOMIC_STORE(c->graph_frames, buffer_frames);
+		pw_loop_signal_event(pw_thread_loop_get_loop(c->context.loop),
+				c->context.batch_event);
+	}
 
 	sample_rate = pos->clock.rate.denom;
 	if (sample_rate != c->sample_rate) {
 		pw_log_info(NAME" %p: sample_rate %d", c, sample_rate);
-		c->sample_rate = sample_rate;
+		ATOMIC_STORE(c->sample_rate, sample_rate);
+		changed = true;
 		if (c->srate_callback)
 			c->srate_callback(c->sample_rate, c->srate_arg);
 	}
+	if (changed && c->deadline_percent > 0)
+		pw_loop_signal_event(c->notify_loop, c->deadline_event);
 
 	c->jack_state = position_to_jack(driver, &c->jack_position);
 
@@ -950,10 +3098,19 @@ static inline uint32_t cycle_wait(struct client *c)
 {
 	int res;
 
-	res = pw_data_loop_wait(c->loop, -1);
-	if (res <= 0) {
-		pw_log_warn(NAME" %p: wait error %m", c);
-		return 0;
+	while (true) {
+		if (cycle_spin(c)) {
+			/* still dispatch pending invokes but don't sleep */
+			pw_data_loop_wait(c->loop, 0);
+			break;
+		}
+		res = pw_data_loop_wait(c->loop, -1);
+		if (res <= 0) {
+			pw_log_warn(NAME" %p: wait error %m", c);
+			return 0;
+		}
+		if (cycle_wakeup(c))
+			break;
 	}
 	return cycle_run(c);
 }
@@ -962,7 +3119,8 @@ static inline void signal_sync(struct client *c)
 {
 	struct timespec ts;
 	uint64_t cmd, nsec;
-	struct link *l;
+	struct signal_table *t;
+	uint32_t i;
 	struct pw_node_activation *activation = c->activation;
 
 	process_tee(c);
@@ -972,26 +3130,35 @@ static inline void signal_sync(struct client *c)
 	activation->status = PW_NODE_ACTIVATION_FINISHED;
 	activation->finish_time = nsec;
 
-	cmd = 1;
-	pw_array_for_each(l, &c->links) {
-		struct pw_node_activation_state *state;
-
-		if (l->activation == NULL)
-			continue;
+	if ((t = c->signals) == NULL)
+		return;
 
-		state = &l->activation->state[0];
+	cmd = 1;
+	for (i = 0; i < t->n_links; i++) {
+		struct pw_node_activation_state *state = t->state[i];
 
-		pw_log_trace(NAME" %p: link %p %p %d/%d", c, l, state,
+		pw_log_trace(NAME" %p: link %u %p %d/%d", c, t->node_id[i], state,
 				state->pending, state->required);
 
 		if (pw_node_activation_state_dec(state, 1)) {
-			l->activation->status = PW_NODE_ACTIVATION_TRIGGERED;
-			l->activation->signal_time = nsec;
+			struct pw_node_activation *a = t->activation[i];
+			uint32_t status;
+
+			a->signal_time = nsec;
 
-			pw_log_trace(NAME" %p: signal %p %p", c, l, state);
+			/* the peer is polling its status, no need to wake it up */
+			status = ATOMIC_LOAD(a->status);
+			if ((status & STATUS_SPINNING) &&
+			    ATOMIC_CAS(a->status, status, PW_NODE_ACTIVATION_TRIGGERED)) {
+				pw_log_trace(NAME" %p: trigger %u %p", c, t->node_id[i], state);
+				continue;
+			}
+			a->status = PW_NODE_ACTIVATION_TRIGGERED;
 
-			if (write(l->signalfd, &cmd, sizeof(cmd)) != sizeof(cmd))
-				pw_log_warn(NAME" %p: write failed %m", c);
+			pw_log_trace(NAME" %p: signal %u %p", c, t->node_id[i], state);
+
+			if (write(t->signalfd[i], &cmd, sizeof(cmd)) != sizeof(cmd))
+				rt_log(c, RT_LOG_WRITE_FAILED, c, errno, t->node_id[i], 0);
 		}
 	}
 }
@@ -1035,21 +3202,40 @@ on_rtsocket_condition(void *data, int fd, uint32_t mask)
 	if (c->thread_callback) {
 		if (!c->thread_entered) {
 			c->thread_entered = true;
+			if (c->flush_denormals)
+				flush_denormals();
 			c->thread_callback(c->thread_arg);
 		}
 		return;
 	} else if (mask & SPA_IO_IN) {
-		uint32_t buffer_frames;
+		uint32_t buffer_frames, n_cycles = 0;
 		int status;
 
-		buffer_frames = cycle_run(c);
+		if (!cycle_wakeup(c))
+			return;
+
+		/* when spinning, run a limited number of cycles before going
+		 * back to the loop so that invokes are not starved */
+		do {
+			buffer_frames = cycle_run(c);
 
-		status = c->process_callback ? c->process_callback(buffer_frames, c->process_arg) : 0;
+			status = c->process_callback ? c->process_callback(buffer_frames, c->process_arg) : 0;
 
-		cycle_signal(c, status);
+			cycle_signal(c, status);
+		} while (++n_cycles < MAX_INLINE_CYCLES &&
+		    c->socket_source != NULL &&
+		    cycle_spin(c));
 	}
 }
 
+static void log_spin_stats(struct client *c)
+{
+	if (c->spin_nsec == 0)
+		return;
+	pw_log_info(NAME" %p: spin %"PRIu64"ns: %"PRIu64" hits %"PRIu64" fallbacks", c,
+			c->spin_nsec, c->spin_hits, c->spin_fallbacks);
+}
+
 static void clear_link(struct client *c, struct link *link)
 {
 	link->node_id = SPA_ID_INVALID;
@@ -1069,10 +3255,13 @@ static void clean_transport(struct client *c)
 
 	unhandle_socket(c);
 
+	free(c->signals);
+	c->signals = NULL;
+	c->driver_activation = NULL;
+
 	pw_array_for_each(l, &c->links)
-		if (l->node_id != SPA_ID_INVALID)
-			clear_link(c, l);
-	pw_array_clear(&c->links);
+		clear_link(c, l);
+	pw_array_reset(&c->links);
 
 	c->node_id = SPA_ID_INVALID;
 }
@@ -1095,6 +3284,7 @@ static int client_node_transport(void *object,
 		return -errno;
 	}
 	c->activation = c->mem->ptr;
+	lock_memmap(c, c->mem);
 
 	pw_log_debug(NAME" %p: create client transport with fds %d %d for node %u",
 			c, readfd, writefd, node_id);
@@ -1152,6 +3342,7 @@ static int client_node_set_io(void *object,
 			return -errno;
                 }
 		ptr = mm->ptr;
+		lock_memmap(c, mm);
         }
 	pw_log_debug(NAME" %p: set io %s %p", c,
 			spa_debug_type_find_name(spa_type_io, id), ptr);
@@ -1227,27 +3418,6 @@ static int client_node_remove_port(void *object,
 	return -ENOTSUP;
 }
 
-static int clear_buffers(struct client *c, struct mix *mix)
-{
-	struct port *port = mix->port;
-        struct buffer *b;
-	uint32_t i, j;
-
-        pw_log_debug(NAME" %p: port %p clear buffers", c, port);
-
-	for (i = 0; i < mix->n_buffers; i++) {
-		b = &mix->buffers[i];
-
-		for (j = 0; j < b->n_mem; j++)
-			pw_memmap_free(b->mem[j]);
-
-		b->n_mem = 0;
-        }
-	mix->n_buffers = 0;
-	spa_list_init(&mix->queue);
-	return 0;
-}
-
 static int param_enum_format(struct client *c, struct port *p,
 		struct spa_pod **param, struct spa_pod_builder *b)
 {
@@ -1344,16 +3514,27 @@ static int param_buffers(struct client *c, struct port *p,
 		struct spa_pod **param, struct spa_pod_builder *b)
 {
 	switch (p->object->port.type_id) {
-	case 0:
 	case 1:
+		*param = spa_pod_builder_add_object(b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(1, 1, MAX_BUFFERS),
+			SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+			SPA_PARAM_BUFFERS_size,    SPA_POD_CHOICE_RANGE_Int(
+								p->midi_size,
+								p->midi_size,
+								INT32_MAX),
+			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(4),
+			SPA_PARAM_BUFFERS_align,   SPA_POD_Int(16));
+		break;
+	case 0:
 		*param = spa_pod_builder_add_object(b,
 			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
 			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(1, 1, MAX_BUFFERS),
 			SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
 			SPA_PARAM_BUFFERS_size,    SPA_POD_CHOICE_STEP_Int(
-								MAX_BUFFER_FRAMES * sizeof(float),
+								c->max_frames * sizeof(float),
 								sizeof(float),
-								MAX_BUFFER_FRAMES * sizeof(float),
+								c->max_frames * sizeof(float),
 								sizeof(float)),
 			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(4),
 			SPA_PARAM_BUFFERS_align,   SPA_POD_Int(16));
@@ -1436,23 +3617,14 @@ static int port_set_format(struct client *c, struct port *p,
 	return 0;
 }
 
-static int client_node_port_set_param(void *object,
-                                enum spa_direction direction,
-                                uint32_t port_id,
-                                uint32_t id, uint32_t flags,
-                                const struct spa_pod *param)
+static int port_update_params(struct client *c, struct port *p)
 {
-	struct client *c = (struct client *) object;
-	struct port *p = GET_PORT(c, direction, port_id);
 	struct spa_pod *params[4];
 	uint8_t buffer[4096];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-	pw_log_debug("port %p: %d.%d id:%d %p", p, direction, port_id, id, param);
-
-        if (id == SPA_PARAM_Format) {
-		port_set_format(c, p, flags, param);
-	}
+	if (p->object->port.type_id == 1)
+		ATOMIC_STORE(p->midi_size, midi_buffer_size(c, p->size_hint));
 
 	param_enum_format(c, p, &params[0], &b);
 	param_format(c, p, &params[1], &b);
@@ -1460,21 +3632,64 @@ static int client_node_port_set_param(void *object,
 	param_io(c, p, &params[3], &b);
 
 	return pw_client_node_proxy_port_update(c->node_proxy,
-					 direction,
-					 port_id,
+					 p->direction,
+					 p->id,
 					 PW_CLIENT_NODE_PORT_UPDATE_PARAMS,
 					 4,
 					 (const struct spa_pod **) params,
 					 NULL);
 }
 
+/* must be called with the thread loop lock. Makes the existing ports
+ * renegotiate buffers that can hold the larger quantum */
+static void grow_quantum(struct client *c, uint32_t nframes)
+{
+	struct port *p;
+	uint32_t i;
+
+	if (nframes <= c->quantum && nframes <= c->max_frames)
+		return;
+
+	c->quantum = SPA_MAX(c->quantum, nframes);
+	if (nframes > c->max_frames) {
+		pw_log_info(NAME" %p: max frames %d -> %d", c, c->max_frames, nframes);
+		c->max_frames = nframes;
+	}
+	for (i = 0; i < 2; i++) {
+		spa_list_for_each(p, &c->ports[i], link)
+			port_update_params(c, p);
+	}
+}
+
+static int client_node_port_set_param(void *object,
+                                enum spa_direction direction,
+                                uint32_t port_id,
+                                uint32_t id, uint32_t flags,
+                                const struct spa_pod *param)
+{
+	struct client *c = (struct client *) object;
+	struct port *p = GET_PORT(c, direction, port_id);
+
+	if (p == NULL || !p->valid)
+		return -EINVAL;
+
+	pw_log_debug("port %p: %d.%d id:%d %p", p, direction, port_id, id, param);
+
+        if (id == SPA_PARAM_Format) {
+		port_set_format(c, p, flags, param);
+	}
+
+	return port_update_params(c, p);
+}
+
 static void init_buffer(struct port *p, void *data, size_t maxframes)
 {
 	if (p->object->port.type_id == 1) {
 		struct midi_buffer *mb = data;
 		mb->magic = MIDI_BUFFER_MAGIC;
-		mb->buffer_size = MAX_BUFFER_FRAMES * sizeof(float);
-		mb->nframes = maxframes;
+		mb->buffer_size = maxframes * sizeof(float);
+		/* the buffer is sized on the events, not the frames */
+		mb->nframes = p->client->max_frames;
 		mb->write_pos = 0;
 		mb->event_count = 0;
 		mb->lost_events = 0;
@@ -1484,6 +3699,32 @@ static void init_buffer(struct port *p, void *data, size_t maxframes)
 		memset(data, 0, maxframes * sizeof(float));
 }
 
+static int
+do_use_buffers(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct mix *mix = user_data;
+	struct port *p = mix->port;
+	uint32_t i, n_buffers = *(uint32_t *) data;
+
+	for (i = 0; i < n_buffers; i++) {
+		struct buffer *b = &mix->buffers[i];
+
+		if (b->n_mem == 0)
+			continue;
+
+		SPA_FLAG_SET(b->flags, BUFFER_FLAG_OUT);
+		if (p->direction == SPA_DIRECTION_OUTPUT)
+			reuse_buffer(p->client, mix, b->id);
+	}
+	mix->n_buffers = n_buffers;
+
+	init_buffer(p, p->emptyptr, p->empty_frames);
+	p->zeroed = true;
+	invalidate_buffer(p);
+	return 0;
+}
+
 static int client_node_port_use_buffers(void *object,
                                   enum spa_direction direction,
                                   uint32_t port_id,
@@ -1495,10 +3736,11 @@ static int client_node_port_use_buffers(void *object,
 	struct client *c = (struct client *) object;
 	struct port *p = GET_PORT(c, direction, port_id);
 	struct buffer *b;
-	uint32_t i, j, fl, res;
+	uint32_t i, j, fl;
+	int res;
 	struct mix *mix;
 
-	if (!p->valid) {
+	if (p == NULL || !p->valid) {
 		res = -EINVAL;
 		goto done;
 	}
@@ -1534,6 +3776,7 @@ static int client_node_port_use_buffers(void *object,
 		}
 
 		buf = buffers[i].buffer;
+		lock_memmap(c, mm);
 
 		b = &mix->buffers[i];
 		b->id = i;
@@ -1570,7 +3813,7 @@ static int client_node_port_use_buffers(void *object,
 				if (bm == NULL) {
 					pw_log_error(NAME" %p: unknown buffer mem %u", c, mem_id);
 					res = -ENODEV;
-					goto done;
+					goto error;
 
 				}
 
@@ -1583,7 +3826,7 @@ static int client_node_port_use_buffers(void *object,
 					res = -errno;
 					pw_log_error(NAME" %p: failed to map buffer mem %m", c);
 					d->data = NULL;
-					goto done;
+					goto error;
 				}
 				b->mem[b->n_mem++] = bmm;
 				d->data = bmm->ptr;
@@ -1599,29 +3842,42 @@ static int client_node_port_use_buffers(void *object,
 			} else {
 				pw_log_warn("unknown buffer data type %d", d->type);
 			}
-			if (mlock(d->data, d->maxsize) < 0)
-				pw_log_warn(NAME" %p: Failed to mlock memory %p %u: %m", c,
-						d->data, d->maxsize);
+			/* already locked with the buffer memory */
+			if (!c->lock_memory || d->type != SPA_DATA_MemPtr)
+				lock_memory(c, d->data, d->maxsize);
 		}
 
-		init_buffer(p, p->emptyptr, MAX_BUFFER_FRAMES);
-		p->zeroed = true;
-
-		SPA_FLAG_SET(b->flags, BUFFER_FLAG_OUT);
-		if (direction == SPA_DIRECTION_OUTPUT)
-			reuse_buffer(c, mix, b->id);
-
+		if (b->n_datas > 0 &&
+		    (res = ensure_empty(c, p, b->datas[0].maxsize / sizeof(float))) < 0) {
+			pw_log_error(NAME" %p: can't allocate empty buffer: %s", c, spa_strerror(res));
+			goto error;
+		}
 	}
 	pw_log_debug(NAME" %p: have %d buffers", c, n_buffers);
-	mix->n_buffers = n_buffers;
+	rt_invoke(c, do_use_buffers, &n_buffers, sizeof(n_buffers), mix);
 	res = 0;
+	goto done;
 
+      error:
+	/* the process thread never saw these, unmap what was mapped so far */
+	release_buffers(c, mix, i + 1);
       done:
 	if (res < 0)
 		pw_proxy_error((struct pw_proxy*)c->node_proxy, res, spa_strerror(res));
 	return res;
 }
 
+static int
+do_set_io(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct mix *mix = user_data;
+
+	mix->io = *(struct spa_io_buffers **) data;
+	invalidate_buffer(mix->port);
+	return 0;
+}
+
 static int client_node_port_set_io(void *object,
                              enum spa_direction direction,
                              uint32_t port_id,
@@ -1633,19 +3889,23 @@ static int client_node_port_set_io(void *object,
 {
 	struct client *c = (struct client *) object;
 	struct port *p = GET_PORT(c, direction, port_id);
-        struct pw_memmap *mm;
+        struct pw_memmap *mm, *old;
         struct mix *mix;
 	uint32_t tag[5] = { c->node_id, direction, port_id, mix_id, id };
         void *ptr;
 	int res = 0;
 
+	if (p == NULL || !p->valid) {
+		res = -EINVAL;
+		goto exit;
+	}
+
 	if ((mix = ensure_mix(c, p, mix_id)) == NULL) {
 		res = -ENOMEM;
 		goto exit;
 	}
 
-	if ((mm = pw_mempool_find_tag(c->remote->pool, tag, sizeof(tag))) != NULL)
-		pw_memmap_free(mm);
+	old = pw_mempool_find_tag(c->remote->pool, tag, sizeof(tag));
 
         if (mem_id == SPA_ID_INVALID) {
                 mm = ptr = NULL;
@@ -1660,6 +3920,7 @@ static int client_node_port_set_io(void *object,
                         goto exit;
                 }
 		ptr = mm->ptr;
+		lock_memmap(c, mm);
         }
 
 	pw_log_debug(NAME" %p: port %p mix:%d set io:%s id:%u ptr:%p", c, p, mix_id,
@@ -1667,12 +3928,15 @@ static int client_node_port_set_io(void *object,
 
 	switch (id) {
 	case SPA_IO_Buffers:
-                mix->io = ptr;
+		rt_invoke(c, do_set_io, &ptr, sizeof(ptr), mix);
 		break;
 	default:
 		break;
 	}
 
+	if (old != NULL)
+		pw_memmap_free(old);
+
       exit:
 	if (res < 0)
 		pw_proxy_error((struct pw_proxy*)c->node_proxy, res, spa_strerror(res));
@@ -1688,7 +3952,8 @@ static int client_node_set_activation(void *object,
 {
 	struct client *c = (struct client *) object;
 	struct pw_memmap *mm;
-	struct link *link;
+	struct link *link, old;
+	uint32_t idx;
 	void *ptr;
 	int res = 0;
 
@@ -1712,34 +3977,53 @@ static int client_node_set_activation(void *object,
 			goto exit;
 		}
 		ptr = mm->ptr;
+		lock_memmap(c, mm);
 	}
 
 	pw_log_debug(NAME" %p: set activation %u: %u %u %u %p", c, node_id,
 			mem_id, offset, size, ptr);
 
 	if (ptr) {
-		link = pw_array_add(&c->links, sizeof(struct link));
-		if (link == NULL) {
+		/* make room first so that nothing changes when this fails */
+		if (pw_array_add(&c->links, sizeof(struct link)) == NULL) {
 			res = -errno;
+			pw_memmap_free(mm);
+			close(signalfd);
 			goto exit;
 		}
+		c->links.size -= sizeof(struct link);
+	}
+
+	old.node_id = SPA_ID_INVALID;
+	if ((link = find_activation(&c->links, node_id)) != NULL) {
+		/* replaced or removed, free it after the RT thread let go */
+		old = *link;
+		remove_activation(&c->links, link);
+	} else if (ptr == NULL) {
+		res = -EINVAL;
+		goto exit;
+	}
+
+	if (ptr) {
+		idx = link_index(&c->links, node_id);
+		pw_array_add(&c->links, sizeof(struct link));
+		link = pw_array_get_unchecked(&c->links, idx, struct link);
+		memmove(link + 1, link, SPA_PTRDIFF(pw_array_end(&c->links), link + 1));
 		link->node_id = node_id;
 		link->mem = mm;
 		link->activation = ptr;
 		link->signalfd = signalfd;
 	}
-	else {
-		link = find_activation(&c->links, node_id);
-		if (link == NULL) {
-			res = -EINVAL;
-			goto exit;
-		}
-		clear_link(c, link);
-	}
 
 	if (c->driver_id == node_id)
 		update_driver_activation(c);
 
+	if ((res = update_signals(c)) < 0)
+		goto exit;
+
+	if (old.node_id != SPA_ID_INVALID)
+		clear_link(c, &old);
+
       exit:
 	if (res < 0)
 		pw_proxy_error((struct pw_proxy*)c->node_proxy, res, spa_strerror(res));
@@ -1791,6 +4075,34 @@ static const char* type_to_string(jack_port_type_id_t type_id)
 	}
 }
 
+static void queue_object_notify(struct client *c, struct object *o, int reg)
+{
+	struct notification *n;
+
+	switch (o->type) {
+	case PW_TYPE_INTERFACE_Node:
+		if ((n = queue_notify(c, NOTIFY_CLIENT_REGISTER, reg)) != NULL)
+			snprintf(n->name, sizeof(n->name), "%s", o->node.name);
+		break;
+	case PW_TYPE_INTERFACE_Port:
+		if ((n = queue_notify(c, NOTIFY_PORT_REGISTER, reg)) != NULL)
+			n->id = o->id;
+		break;
+	case PW_TYPE_INTERFACE_Link:
+		if ((n = queue_notify(c, NOTIFY_PORT_CONNECT, reg)) != NULL) {
+			n->id = o->port_link.src;
+			n->dst = o->port_link.dst;
+		}
+		break;
+	default:
+		return;
+	}
+	if (n != NULL) {
+		n->object = o;
+		o->refs++;
+	}
+}
+
 static void registry_event_global(void *data, uint32_t id,
                                   uint32_t permissions, uint32_t type, uint32_t version,
                                   const struct spa_dict *props)
@@ -1882,7 +4194,11 @@ static void registry_event_global(void *data, uint32_t id,
 
 			snprintf(o->port.name, sizeof(o->port.name), "%s:%s", ot->node.name, str);
 			o->port.port_id = SPA_ID_INVALID;
+			o->port.port = NULL;
 			o->port.priority = ot->node.priority;
+			o->type = PW_TYPE_INTERFACE_Port;
+			port_name_insert(c, o);
+			init_port_links(o);
 		}
 
 		if ((str = spa_dict_lookup(props, PW_KEY_OBJECT_PATH)) != NULL)
@@ -1907,6 +4223,9 @@ static void registry_event_global(void *data, uint32_t id,
 			o->port.playback_latency.max = 1024;
 		}
 
+		attach_port_links(c, o, id);
+		graph_changed(c);
+
 		pw_log_debug(NAME" %p: add port %d %s %d", c, id, o->port.name, type_id);
 		break;
 	}
@@ -1922,6 +4241,9 @@ static void registry_event_global(void *data, uint32_t id,
 			goto exit_free;
 		o->port_link.dst = pw_properties_parse_int(str);
 
+		o->type = PW_TYPE_INTERFACE_Link;
+		add_link(c, o);
+
 		pw_log_debug(NAME" %p: add link %d %d->%d", c, id,
 				o->port_link.src, o->port_link.dst);
 		break;
@@ -1933,30 +4255,15 @@ static void registry_event_global(void *data, uint32_t id,
 	o->type = type;
 	o->id = id;
 
+	if (type == PW_TYPE_INTERFACE_Port)
+		port_index_insert(c, o);
+
         size = pw_map_get_size(&c->context.globals);
         while (id > size)
 		pw_map_insert_at(&c->context.globals, size++, NULL);
 	pw_map_insert_at(&c->context.globals, id, o);
 
-	pw_thread_loop_unlock(c->context.loop);
-
-	switch (type) {
-	case PW_TYPE_INTERFACE_Node:
-		if (c->registration_callback)
-			c->registration_callback(o->node.name, 1, c->registration_arg);
-		break;
-
-	case PW_TYPE_INTERFACE_Port:
-		if (c->portregistration_callback)
-			c->portregistration_callback(o->id, 1, c->portregistration_arg);
-		break;
-
-	case PW_TYPE_INTERFACE_Link:
-		if (c->connect_callback)
-			c->connect_callback(o->port_link.src, o->port_link.dst, 1, c->connect_arg);
-		break;
-	}
-	pw_thread_loop_lock(c->context.loop);
+	queue_object_notify(c, o, 1);
 
       exit:
 	return;
@@ -1976,23 +4283,7 @@ static void registry_event_global_remove(void *object, uint32_t id)
 	if (o == NULL)
 		return;
 
-	pw_thread_loop_unlock(c->context.loop);
-
-	switch (o->type) {
-	case PW_TYPE_INTERFACE_Node:
-		if (c->registration_callback)
-			c->registration_callback(o->node.name, 0, c->registration_arg);
-		break;
-	case PW_TYPE_INTERFACE_Port:
-		if (c->portregistration_callback)
-			c->portregistration_callback(o->id, 0, c->portregistration_arg);
-		break;
-	case PW_TYPE_INTERFACE_Link:
-		if (c->connect_callback)
-			c->connect_callback(o->port_link.src, o->port_link.dst, 0, c->connect_arg);
-		break;
-	}
-	pw_thread_loop_lock(c->context.loop);
+	queue_object_notify(c, o, 0);
 
 	/* JACK clients expect the objects to hang around after
 	 * they are unregistered. We keep them in the map but reuse the
@@ -2019,11 +4310,10 @@ jack_client_t * jack_client_open (const char *client_name,
 	struct spa_dict props;
 	struct spa_dict_item items[6];
 	const struct spa_support *support;
-	uint32_t n_support;
+	uint32_t i, n_support, quantum, rate;
 	const char *str;
 	struct spa_cpu *cpu_iface;
 	struct spa_node_info ni;
-	int i;
 
         if (getenv("PIPEWIRE_NOJACK") != NULL)
 		goto disabled;
@@ -2036,6 +4326,64 @@ jack_client_t * jack_client_open (const char *client_name,
 
 	client->node_id = SPA_ID_INVALID;
 	strncpy(client->name, client_name, JACK_CLIENT_NAME_SIZE);
+
+	if ((str = getenv("PIPEWIRE_PROPS")) != NULL)
+		client->props = pw_properties_new_string(str);
+	if (client->props == NULL)
+		client->props = pw_properties_new(NULL, NULL);
+	if (client->props == NULL)
+		goto init_failed;
+
+	if ((str = get_config(client, "jack.spin-usec", "PIPEWIRE_JACK_SPIN_USEC")) != NULL)
+		client->spin_nsec = pw_properties_parse_uint64(str) * SPA_NSEC_PER_USEC;
+	else
+		client->spin_nsec = DEFAULT_SPIN_USEC * SPA_NSEC_PER_USEC;
+
+	if ((str = get_config(client, "jack.rt-priority", "PIPEWIRE_JACK_RT_PRIORITY")) != NULL)
+		client->rt_priority = atoi(str);
+	else
+		client->rt_priority = DEFAULT_RT_PRIORITY;
+
+	client->rt_policy = DEFAULT_RT_POLICY;
+	if ((str = get_config(client, "jack.rt-policy", "PIPEWIRE_JACK_RT_POLICY")) != NULL) {
+		if (!strcmp(str, "rr"))
+			client->rt_policy = SCHED_RR;
+		else if (!strcmp(str, "fifo"))
+			client->rt_policy = SCHED_FIFO;
+		else
+			pw_log_warn(NAME" %p: unknown rt policy '%s'", client, str);
+	}
+
+	if ((str = get_config(client, "jack.flush-denormals", "PIPEWIRE_JACK_FLUSH_DENORMALS")) != NULL)
+		client->flush_denormals = pw_properties_parse_bool(str);
+	else
+		client->flush_denormals = true;
+
+	if ((str = get_config(client, "jack.mlock", "PIPEWIRE_JACK_MLOCK")) != NULL)
+		client->lock_memory = pw_properties_parse_bool(str);
+	if ((str = get_config(client, "jack.rt-stack", "PIPEWIRE_JACK_RT_STACK")) != NULL)
+		client->rt_stack_size = pw_properties_parse_uint64(str) * 1024;
+	else
+		client->rt_stack_size = DEFAULT_RT_STACK;
+	if (client->lock_memory)
+		lock_memory(client, client, sizeof(struct client));
+
+	if ((str = get_config(client, "jack.rt-deadline", "PIPEWIRE_JACK_RT_DEADLINE")) != NULL)
+		client->deadline_percent = SPA_CLAMP(atoi(str), 0, 100);
+
+	if ((str = get_config(client, "jack.rt-cpus", "PIPEWIRE_JACK_RT_CPUS")) != NULL)
+		init_cpu_placement(client, str);
+	if (client->have_rt_cpus && client->deadline_percent > 0)
+		pw_log_warn(NAME" %p: the kernel refuses deadline tasks with a restricted "
+				"affinity, the data thread is not pinned to the rt cpus", client);
+
+	if ((str = get_config(client, "jack.midi-buffer-size", "PIPEWIRE_JACK_MIDI_BUFFER_SIZE")) != NULL) {
+		int size = atoi(str);
+		if (size > 0)
+			client->midi_buffer_size = size;
+		else
+			pw_log_warn(NAME" %p: invalid MIDI buffer size '%s'", client, str);
+	}
 	client->context.main = pw_main_loop_new(NULL);
 	client->context.loop = pw_thread_loop_new(pw_main_loop_get_loop(client->context.main), client_name);
         client->context.core = pw_core_new(pw_thread_loop_get_loop(client->context.loop), NULL, 0);
@@ -2043,18 +4391,56 @@ jack_client_t * jack_client_open (const char *client_name,
 	spa_list_init(&client->context.nodes);
 	spa_list_init(&client->context.ports);
 	spa_list_init(&client->context.links);
+	spa_list_init(&client->context.pending_src_links);
+	spa_list_init(&client->context.pending_dst_links);
+	spa_list_init(&client->context.graph_retired);
+	pthread_mutex_init(&client->context.pattern_lock, NULL);
+	client->context.batch_event = pw_loop_add_event(
+			pw_thread_loop_get_loop(client->context.loop),
+			on_batch_event, client);
+
+	pw_array_init(&client->notify_pending, 64 * sizeof(struct notification));
+	pthread_mutex_init(&client->notify_lock, NULL);
+	spa_list_init(&client->notify_batches);
+	client->notify_loop = pw_loop_new(NULL);
+	if (client->notify_loop == NULL)
+		goto init_failed;
+	client->notify_thread = pw_thread_loop_new(client->notify_loop, "jack-notify");
+	client->notify_event = pw_loop_add_event(client->notify_loop,
+			on_notify_event, client);
+	client->deadline_event = pw_loop_add_event(client->notify_loop,
+			on_deadline_event, client);
+	spa_ringbuffer_init(&client->rt_log.ring);
+	client->rt_log_event = pw_loop_add_event(client->notify_loop,
+			on_rt_log_event, client);
+	client->rt_log_timer = pw_loop_add_timer(client->notify_loop,
+			on_rt_log_timeout, client);
+	pw_thread_loop_start(client->notify_thread);
+	if (client->have_rt_cpus)
+		pw_loop_invoke(client->notify_loop, do_set_other_affinity,
+				1, NULL, 0, true, client);
+	for (i = 0; i < N_PORT_TYPES; i++)
+		pw_array_init(&client->context.port_index[i], 64 * sizeof(struct object *));
 
 	support = pw_core_get_support(client->context.core, &n_support);
 
-	mix2 = mix2_c;
-	cpu_iface = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_CPU);
-	if (cpu_iface) {
-#if defined (__SSE__)
-		uint32_t flags = spa_cpu_get_flags(cpu_iface);
-		if (flags & SPA_CPU_FLAG_SSE)
-			mix2 = mix2_sse;
-#endif
+	/* the CPU interface only exists once we have a core, select the
+	 * mix function for the whole process on the first open */
+	pthread_mutex_lock(&globals.lock);
+	if (globals.mix_function == NULL) {
+		const struct mix_info *info;
+		uint32_t flags = 0;
+
+		cpu_iface = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_CPU);
+		if (cpu_iface)
+			flags = spa_cpu_get_flags(cpu_iface);
+
+		info = mix_find_info(flags);
+		pw_log_info(NAME" %p: cpu flags %08x, using %s mix function",
+				client, flags, info->name);
+		globals.mix_function = info->func;
 	}
+	pthread_mutex_unlock(&globals.lock);
 
 	client->loop = pw_data_loop_new(NULL);
 	if (client->loop == NULL)
@@ -2064,17 +4450,22 @@ jack_client_t * jack_client_open (const char *client_name,
 
 	client->buffer_frames = (uint32_t)-1;
 	client->sample_rate = (uint32_t)-1;
+	client->max_frames = DEFAULT_MAX_BUFFER_FRAMES;
+	client->quantum = DEFAULT_BUFFER_FRAMES;
 
-        spa_list_init(&client->free_mix);
-	for (i = 0; i < MAX_MIX; i++)
-		spa_list_append(&client->free_mix, &client->mix_pool[i].link);
+	pw_array_init(&client->slabs, 16 * sizeof(struct slab));
+	spa_list_init(&client->free_mix);
 
 	init_port_pool(client, SPA_DIRECTION_INPUT);
 	init_port_pool(client, SPA_DIRECTION_OUTPUT);
+	spa_list_init(&client->midi_outputs);
 
 	pw_map_init(&client->context.globals, 64, 64);
 
 	pw_thread_loop_start(client->context.loop);
+	if (client->have_rt_cpus)
+		pw_loop_invoke(pw_thread_loop_get_loop(client->context.loop),
+				do_set_other_affinity, 1, NULL, 0, true, client);
 
 	pw_thread_loop_lock(client->context.loop);
         client->remote = pw_remote_new(client->context.core,
@@ -2126,6 +4517,11 @@ jack_client_t * jack_client_open (const char *client_name,
 	if ((str = getenv("PIPEWIRE_LATENCY")) == NULL)
 		str = DEFAULT_LATENCY;
 	items[props.n_items++] = SPA_DICT_ITEM_INIT(PW_KEY_NODE_LATENCY, str);
+	if (sscanf(str, "%u/%u", &quantum, &rate) == 2) {
+		client->quantum = quantum;
+		if (quantum > client->max_frames)
+			client->max_frames = quantum;
+	}
 	items[props.n_items++] = SPA_DICT_ITEM_INIT(PW_KEY_NODE_ALWAYS_PROCESS, "1");
 
 	client->node_proxy = pw_core_proxy_create_object(client->core_proxy,
@@ -2143,8 +4539,8 @@ jack_client_t * jack_client_open (const char *client_name,
 			&client->proxy_listener, &proxy_events, client);
 
 	ni = SPA_NODE_INFO_INIT();
-	ni.max_input_ports = MAX_PORTS;
-	ni.max_output_ports = MAX_PORTS;
+	ni.max_input_ports = UINT32_MAX;
+	ni.max_output_ports = UINT32_MAX;
 	ni.change_mask = SPA_NODE_CHANGE_MASK_FLAGS;
 	ni.flags = SPA_NODE_FLAG_RT;
 
@@ -2196,17 +4592,55 @@ SPA_EXPORT
 int jack_client_close (jack_client_t *client)
 {
 	struct client *c = (struct client *) client;
+	struct notify_batch *b;
+	struct notification *n;
+	uint32_t i;
 
 	pw_log_debug(NAME" %p: close", client);
 
 	pw_thread_loop_stop(c->context.loop);
 
 	c->destroyed = true;
+	pw_loop_destroy_source(pw_thread_loop_get_loop(c->context.loop),
+			c->context.batch_event);
+
+	/* pending notifications are dropped */
+	pw_thread_loop_stop(c->notify_thread);
+	pw_loop_destroy_source(c->notify_loop, c->notify_event);
+	pw_loop_destroy_source(c->notify_loop, c->deadline_event);
+	pw_loop_destroy_source(c->notify_loop, c->rt_log_event);
+	if (c->rt_log_timer)
+		pw_loop_destroy_source(c->notify_loop, c->rt_log_timer);
+	rt_log_flush(c, true);
+	pw_thread_loop_destroy(c->notify_thread);
+	pw_loop_destroy(c->notify_loop);
+	spa_list_consume(b, &c->notify_batches, link) {
+		spa_list_remove(&b->link);
+		free_batch(c, b);
+	}
+	pthread_mutex_destroy(&c->notify_lock);
 	pw_core_destroy(c->context.core);
 	pw_thread_loop_destroy(c->context.loop);
 	pw_main_loop_destroy(c->context.main);
+	pw_properties_free(c->props);
 
 	pw_log_debug(NAME" %p: free", client);
+	object_hash_clear(&c->context.port_names);
+	object_hash_clear(&c->context.link_ports);
+	for (i = 0; i < N_PORT_TYPES; i++)
+		pw_array_clear(&c->context.port_index[i]);
+	clear_patterns(c);
+	pthread_mutex_destroy(&c->context.pattern_lock);
+	graph_clear(c);
+	free(c->signals);
+	pw_array_for_each(n, &c->notify_pending) {
+		free(n->old_name);
+		free(n->new_name);
+	}
+	pw_array_clear(&c->notify_pending);
+	pw_array_clear(&c->port_pool[SPA_DIRECTION_INPUT]);
+	pw_array_clear(&c->port_pool[SPA_DIRECTION_OUTPUT]);
+	free_slabs(c);
 	free(c);
 
 	return 0;
@@ -2285,12 +4719,85 @@ void jack_internal_client_close (const char *client_name)
 	pw_log_warn("not implemented %s", client_name);
 }
 
+/* runs in the data thread, fault in and lock the stack that the process
+ * callbacks will use, within the limits of the thread stack. Without those
+ * limits nothing is touched, that would overflow a small stack. */
+static int
+do_prefault_stack(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct client *c = user_data;
+	pthread_attr_t attr;
+	size_t stack_size, max = 0;
+	uint8_t *stack;
+	int res;
+
+	if ((res = pthread_getattr_np(pthread_self(), &attr)) == 0) {
+		res = pthread_attr_getstacksize(&attr, &max);
+		pthread_attr_destroy(&attr);
+	}
+	if (res != 0) {
+		pw_log_warn(NAME" %p: can't get the data thread stack size: %s", c,
+				spa_strerror(-res));
+		ATOMIC_INC(c->lock_failures);
+		return -res;
+	}
+	stack_size = SPA_MIN(c->rt_stack_size, max / 2);
+
+	stack = alloca(stack_size);
+	memset(stack, 0, stack_size);
+	__asm__ __volatile__("" :: "r"(stack) : "memory");
+
+	lock_memory(c, stack, stack_size);
+	return 0;
+}
+
+/* The memory of the client is locked when it is allocated or mapped, what
+ * is left is the stack of the new data thread. */
+static void lock_rt_memory(struct client *c)
+{
+	pw_loop_invoke(c->loop->loop, do_prefault_stack, 1, NULL, 0, true, c);
+
+	pw_log_info(NAME" %p: process has %zu bytes locked, %u failures", c,
+			get_locked_bytes(), ATOMIC_LOAD(c->lock_failures));
+}
+
+static int
+do_get_tid(struct spa_loop *loop,
+		bool async, uint32_t seq, const void *data, size_t size, void *user_data)
+{
+	struct client *c = user_data;
+	c->data_tid = syscall(SYS_gettid);
+	return 0;
+}
+
 static int do_activate(struct client *c)
 {
 	int res;
 
 	pw_data_loop_start(c->loop);
 
+	if (c->lock_memory)
+		lock_rt_memory(c);
+
+	/* a new thread, the notify thread makes it a deadline task with the
+	 * quantum that is known now or when the data thread sees one */
+	c->deadline_active = false;
+	c->deadline_period = 0;
+	if (c->deadline_percent > 0) {
+		pw_loop_invoke(c->loop->loop, do_get_tid, 1, NULL, 0, true, c);
+		pw_loop_signal_event(c->notify_loop, c->deadline_event);
+	}
+
+	/* a deadline task can't have a restricted affinity */
+	if (c->have_rt_cpus && c->deadline_percent == 0)
+		set_affinity(c->loop->thread, &c->rt_cpus);
+
+	if (get_rt_priority(c->loop->thread) < 0 &&
+	    (res = set_rt_scheduling(c->loop->thread, c->rt_policy, c->rt_priority)) < 0)
+		pw_log_warn(NAME" %p: can't make data thread realtime: %s", c,
+				spa_strerror(res));
+
 	pw_thread_loop_lock(c->context.loop);
 	pw_log_debug(NAME" %p: activate", c);
 	pw_client_node_proxy_set_active(c->node_proxy, true);
@@ -2342,6 +4849,8 @@ int jack_deactivate (jack_client_t *client)
 
 	pw_data_loop_stop(c->loop);
 
+	log_spin_stats(c);
+
 	if (res < 0)
 		return res;
 
@@ -2652,16 +5161,22 @@ int jack_set_buffer_size (jack_client_t *client, jack_nframes_t nframes)
 	snprintf(latency, sizeof(latency), "%d/%d", nframes, jack_get_sample_rate(client));
 
 	ni = SPA_NODE_INFO_INIT();
-	ni.max_input_ports = MAX_PORTS;
-	ni.max_output_ports = MAX_PORTS;
+	ni.max_input_ports = UINT32_MAX;
+	ni.max_output_ports = UINT32_MAX;
 	ni.change_mask = SPA_NODE_CHANGE_MASK_PROPS;
 	items[0] = SPA_DICT_ITEM_INIT(PW_KEY_NODE_LATENCY, latency);
 	ni.props = &SPA_DICT_INIT_ARRAY(items);
 
+	pw_thread_loop_lock(c->context.loop);
+
 	pw_client_node_proxy_update(c->node_proxy,
                                     PW_CLIENT_NODE_UPDATE_INFO,
 				    0, NULL, &ni);
 
+	grow_quantum(c, nframes);
+
+	pw_thread_loop_unlock(c->context.loop);
+
 	return 0;
 }
 
@@ -2740,18 +5255,24 @@ jack_port_t * jack_port_register (jack_client_t *client,
 	if ((type_id = string_to_type(port_type)) == SPA_ID_INVALID)
 		return NULL;
 
-	if ((p = alloc_port(c, direction)) == NULL)
+	pw_thread_loop_lock(c->context.loop);
+	/* JACK ignores the size of the builtin types, use it as a hint
+	 * for the MIDI buffers. It is in frames, convert it to bytes like
+	 * the quantum */
+	if ((p = alloc_port(c, direction, type_id,
+			type_id == 1 ? SPA_MIN(buffer_frames, INT32_MAX / sizeof(float)) *
+				sizeof(float) : 0)) == NULL) {
+		pw_thread_loop_unlock(c->context.loop);
 		return NULL;
-
+	}
 	o = p->object;
 	o->port.flags = flags;
 	snprintf(o->port.name, sizeof(o->port.name), "%s:%s", c->name, port_name);
-	o->port.type_id = type_id;
+	port_name_insert(c, o);
+	pw_thread_loop_unlock(c->context.loop);
 
 	pw_log_debug(NAME" %p: port %p", c, p);
 
-	spa_list_init(&p->mix);
-
 	port_info = SPA_PORT_INFO_INIT();
 	port_info.change_mask |= SPA_PORT_CHANGE_MASK_FLAGS;
 	port_info.flags = SPA_PORT_FLAG_NO_REF;
@@ -2809,7 +5330,7 @@ int jack_port_unregister (jack_client_t *client, jack_port_t *port)
 
 	pw_thread_loop_lock(c->context.loop);
 
-	p = GET_PORT(c, GET_DIRECTION(o->port.flags), o->port.port_id);
+	p = o->port.port;
 
 	free_port(c, p);
 
@@ -2830,7 +5351,8 @@ static inline void *get_buffer_input_float(struct client *c, struct port *p, jac
 	struct mix *mix;
 	struct buffer *b;
 	struct spa_io_buffers *io;
-	int layer = 0;
+	uint32_t n_ptr = 0, max_mix = ATOMIC_LOAD(p->max_mix);
+	const float **mix_ptr = (const float **) p->mix_data;
 	void *ptr = NULL;
 
 	spa_list_for_each(mix, &p->mix, port_link) {
@@ -2842,13 +5364,15 @@ static inline void *get_buffer_input_float(struct client *c, struct port *p, jac
 
 		io->status = SPA_STATUS_NEED_DATA;
 		b = &mix->buffers[io->buffer_id];
-		if (layer++ == 0)
-			ptr = b->datas[0].data;
-		else  {
-			mix2(p->emptyptr, ptr, b->datas[0].data, frames);
-			ptr = p->emptyptr;
-			p->zeroed = false;
-		}
+		if (n_ptr < max_mix)
+			mix_ptr[n_ptr++] = b->datas[0].data;
+	}
+	if (n_ptr == 1) {
+		ptr = (void *) mix_ptr[0];
+	} else if (n_ptr > 1) {
+		globals.mix_function(p->emptyptr, mix_ptr, n_ptr, frames);
+		ptr = p->emptyptr;
+		p->zeroed = false;
 	}
 	return ptr;
 }
@@ -2857,11 +5381,11 @@ static inline void *get_buffer_input_midi(struct client *c, struct port *p, jack
 {
 	struct mix *mix;
 	struct spa_io_buffers *io;
+	uint32_t n_seq = 0, max_mix = ATOMIC_LOAD(p->max_mix);
+	struct spa_pod_sequence **seq = (struct spa_pod_sequence **) p->mix_data;
 	void *ptr = p->emptyptr;
-	struct spa_pod_sequence *seq[CONNECTION_NUM_FOR_PORT];
-	uint32_t n_seq = 0;
 
-	jack_midi_clear_buffer(ptr);
+	midi_account(p, ptr);
 
 	spa_list_for_each(mix, &p->mix, port_link) {
 		struct spa_data *d;
@@ -2882,26 +5406,37 @@ static inline void *get_buffer_input_midi(struct client *c, struct port *p, jack
 		if (!spa_pod_is_sequence(pod))
 			continue;
 
-		seq[n_seq++] = pod;
+		if (n_seq < max_mix)
+			seq[n_seq++] = pod;
 	}
-	convert_to_midi(seq, n_seq, ptr);
 
+	/* only merging needs a copy */
+	if (n_seq == 1) {
+		midi_view_init(ptr, seq[0]);
+	} else {
+		jack_midi_clear_buffer(ptr);
+		convert_to_midi(seq, n_seq, p->mix_cursors, ptr);
+	}
 	return ptr;
 }
 
 static inline void *get_buffer_output_float(struct client *c, struct port *p, jack_nframes_t frames)
 {
-	void *ptr;
+	struct spa_data *d;
 
-	ptr = get_buffer_output(c, p, frames, sizeof(float));
-	if (ptr == NULL)
-		ptr = p->emptyptr;
+	if ((d = get_buffer_output(c, p, frames, sizeof(float))) == NULL)
+		return p->emptyptr;
 
-	return ptr;
+	return d->data;
 }
 
 static inline void *get_buffer_output_midi(struct client *c, struct port *p, jack_nframes_t frames)
 {
+	struct spa_data *d;
+
+	if ((d = get_buffer_output(c, p, ATOMIC_LOAD(p->midi_size) / sizeof(float), 1)) != NULL)
+		midi_encode_init(p->emptyptr, d->data, d->chunk->size);
+
 	return p->emptyptr;
 }
 
@@ -2911,6 +5446,7 @@ void * jack_port_get_buffer (jack_port_t *port, jack_nframes_t frames)
 	struct object *o = (struct object *) port;
 	struct client *c;
 	struct port *p;
+	uint32_t empty_frames;
 	void *ptr = NULL;
 
 	if (o == NULL)
@@ -2922,7 +5458,22 @@ void * jack_port_get_buffer (jack_port_t *port, jack_nframes_t frames)
 		pw_log_error(NAME" %p: invalid port %p", c, port);
 		return NULL;
 	}
-	p = GET_PORT(c, GET_DIRECTION(o->port.flags), o->port.port_id);
+	p = o->port.port;
+	empty_frames = ATOMIC_LOAD(p->empty_frames);
+
+	/* the application might pass anything here, and the quantum can
+	 * be larger than the buffers until the ones for the new quantum
+	 * are negotiated */
+	frames = SPA_MIN(frames, empty_frames);
+
+	/* hosts often ask for the same buffer more than once per cycle,
+	 * only mix, convert or dequeue the first time */
+	if (p->buffer_ptr != NULL &&
+	    p->buffer_cycle == c->cycle &&
+	    p->buffer_frames >= frames) {
+		pw_log_trace(NAME" %p: port %p cached buffer %p", c, p, p->buffer_ptr);
+		return p->buffer_ptr;
+	}
 
 	if (p->direction == SPA_DIRECTION_INPUT) {
 		switch (p->object->port.type_id) {
@@ -2939,7 +5490,7 @@ void * jack_port_get_buffer (jack_port_t *port, jack_nframes_t frames)
 		if (ptr == NULL) {
 			ptr = p->emptyptr;
 			if (!p->zeroed) {
-				init_buffer(p, ptr, MAX_BUFFER_FRAMES);
+				init_buffer(p, ptr, empty_frames);
 				p->zeroed = true;
 			}
 		}
@@ -2957,6 +5508,10 @@ void * jack_port_get_buffer (jack_port_t *port, jack_nframes_t frames)
 		}
 	}
 
+	p->buffer_cycle = c->cycle;
+	p->buffer_frames = frames;
+	p->buffer_ptr = ptr;
+
 	pw_log_trace(NAME" %p: port %p buffer %p", c, p, ptr);
 	return ptr;
 }
@@ -3015,16 +5570,14 @@ int jack_port_connected (const jack_port_t *port)
 {
 	struct object *o = (struct object *) port;
 	struct client *c = o->client;
-	struct object *l;
+	const struct graph_port *p;
+	struct graph *g;
 	int res = 0;
 
-	pw_thread_loop_lock(c->context.loop);
-	spa_list_for_each(l, &c->context.links, link) {
-		if (l->port_link.src == o->id ||
-		    l->port_link.dst == o->id)
-			res++;
-	}
-	pw_thread_loop_unlock(c->context.loop);
+	if ((g = graph_acquire(c)) != NULL &&
+	    (p = graph_find_object(g, o)) != NULL)
+		res = p->n_peers;
+	graph_release(c);
 
 	return res;
 }
@@ -3035,28 +5588,26 @@ int jack_port_connected_to (const jack_port_t *port,
 {
 	struct object *o = (struct object *) port;
 	struct client *c = o->client;
-	struct object *p, *l;
+	const struct graph_port *p, *peer;
+	struct graph *g;
+	uint32_t i;
 	int res = 0;
 
-	pw_thread_loop_lock(c->context.loop);
-
-	p = find_port(c, port_name);
-	if (p == NULL)
+	if ((g = graph_acquire(c)) == NULL)
 		goto exit;
 
-	if (GET_DIRECTION(p->port.flags) == GET_DIRECTION(o->port.flags))
+	if ((p = graph_find_object(g, o)) == NULL ||
+	    (peer = graph_find_name(g, port_name)) == NULL)
 		goto exit;
 
-	if (p->port.flags & JackPortIsOutput) {
-		l = p;
-		p = o;
-		o = l;
+	for (i = 0; i < p->n_peers; i++) {
+		if (&g->ports[p->peers[i]] == peer) {
+			res = 1;
+			break;
+		}
 	}
-	if (find_link(c, o->id, p->id))
-		res = 1;
-
      exit:
-	pw_thread_loop_unlock(c->context.loop);
+	graph_release(c);
 
 	return res;
 }
@@ -3070,44 +5621,75 @@ const char ** jack_port_get_connections (const jack_port_t *port)
 	return jack_port_get_all_connections((jack_client_t *)c, port);
 }
 
+/* fill names with at most max_names peers of o and return the number
+ * of peers */
+static int get_port_connections(struct client *c, struct object *o,
+		const char **names, int max_names)
+{
+	const struct graph_port *p;
+	struct graph *g;
+	uint32_t i;
+	int count = 0;
+
+	if ((g = graph_acquire(c)) == NULL ||
+	    (p = graph_find_object(g, o)) == NULL)
+		goto done;
+
+	for (i = 0; i < p->n_peers; i++) {
+		if (count < max_names)
+			names[count] = g->ports[p->peers[i]].object->port.name;
+		count++;
+	}
+      done:
+	graph_release(c);
+
+	return count;
+}
+
 SPA_EXPORT
 const char ** jack_port_get_all_connections (const jack_client_t *client,
                                              const jack_port_t *port)
 {
 	struct client *c = (struct client *) client;
 	struct object *o = (struct object *) port;
-	struct object *p, *l;
-	const char **res = malloc(sizeof(char*) * (CONNECTION_NUM_FOR_PORT + 1));
-	int count = 0;
-
-	pw_thread_loop_lock(c->context.loop);
+	const char **res = NULL;
+	int count, n_names;
 
-	spa_list_for_each(l, &c->context.links, link) {
-		if (l->port_link.src == o->id)
-			p = pw_map_lookup(&c->context.globals, l->port_link.dst);
-		else if (l->port_link.dst == o->id)
-			p = pw_map_lookup(&c->context.globals, l->port_link.src);
-		else
-			continue;
-
-		if (p == NULL)
-			continue;
-
-		res[count++] = p->port.name;
-		if (count == CONNECTION_NUM_FOR_PORT)
+	count = get_port_connections(c, o, NULL, 0);
+	while (count > 0) {
+		n_names = count;
+		if ((res = malloc(sizeof(char*) * (n_names + 1))) == NULL)
+			return NULL;
+		count = get_port_connections(c, o, res, n_names);
+		if (count <= n_names)
 			break;
+		/* a newer graph has more connections, try again */
+		free(res);
+		res = NULL;
 	}
-	pw_thread_loop_unlock(c->context.loop);
-
 	if (count == 0) {
 		free(res);
-		res = NULL;
-	} else
-		res[count] = NULL;
+		return NULL;
+	}
+	res[count] = NULL;
 
 	return res;
 }
 
+SPA_EXPORT
+int jack_port_get_all_connections_noalloc (const jack_client_t *client,
+                                           const jack_port_t *port,
+                                           const char **names, int max_names)
+{
+	struct client *c = (struct client *) client;
+	struct object *o = (struct object *) port;
+
+	if (o->type != PW_TYPE_INTERFACE_Port)
+		return -EINVAL;
+
+	return get_port_connections(c, o, names, max_names);
+}
+
 SPA_EXPORT
 int jack_port_tie (jack_port_t *src, jack_port_t *dst)
 {
@@ -3138,10 +5720,23 @@ int jack_port_rename (jack_client_t* client, jack_port_t *port, const char *port
 	struct spa_port_info port_info;
 	struct spa_dict dict;
 	struct spa_dict_item items[1];
+	struct notification *n;
 
 	pw_thread_loop_lock(c->context.loop);
 
-	p = GET_PORT(c, GET_DIRECTION(o->port.flags), o->port.port_id);
+	p = o->port.port;
+
+	if ((n = queue_notify(c, NOTIFY_PORT_RENAME, 1)) != NULL) {
+		n->id = o->id;
+		n->old_name = strdup(o->port.name);
+	}
+
+	port_name_remove(c, o);
+	snprintf(o->port.name, sizeof(o->port.name), "%s:%s", c->name, port_name);
+	port_name_insert(c, o);
+
+	if (n != NULL)
+		n->new_name = strdup(o->port.name);
 
 	port_info = SPA_PORT_INFO_INIT();
 	port_info.change_mask |= SPA_PORT_CHANGE_MASK_PROPS;
@@ -3187,7 +5782,7 @@ int jack_port_set_alias (jack_port_t *port, const char *alias)
 	else
 		goto error;
 
-	p = GET_PORT(c, GET_DIRECTION(o->port.flags), o->port.port_id);
+	p = o->port.port;
 
 	port_info = SPA_PORT_INFO_INIT();
 	port_info.change_mask |= SPA_PORT_CHANGE_MASK_PROPS;
@@ -3233,7 +5828,7 @@ int jack_port_unset_alias (jack_port_t *port, const char *alias)
 	else
 		goto error;
 
-	p = GET_PORT(c, GET_DIRECTION(o->port.flags), o->port.port_id);
+	p = o->port.port;
 
 	port_info = SPA_PORT_INFO_INIT();
 	port_info.change_mask |= SPA_PORT_CHANGE_MASK_PROPS;
@@ -3261,19 +5856,24 @@ int jack_port_get_aliases (const jack_port_t *port, char* const aliases[2])
 {
 	struct object *o = (struct object *) port;
 	struct client *c = o->client;
+	const struct graph_port *p;
+	struct graph *g;
 	int res = 0;
 
-	pw_thread_loop_lock(c->context.loop);
+	if ((g = graph_acquire(c)) == NULL ||
+	    (p = graph_find_object(g, o)) == NULL)
+		goto done;
 
-	if (o->port.alias1[0] != '\0') {
-		snprintf(aliases[0], REAL_JACK_PORT_NAME_SIZE+1, "%s", o->port.alias1);
+	if (p->alias1[0] != '\0') {
+		snprintf(aliases[0], REAL_JACK_PORT_NAME_SIZE+1, "%s", p->alias1);
 		res++;
 	}
-	if (o->port.alias2[0] != '\0') {
-		snprintf(aliases[1], REAL_JACK_PORT_NAME_SIZE+1, "%s", o->port.alias2);
+	if (p->alias2[0] != '\0') {
+		snprintf(aliases[1], REAL_JACK_PORT_NAME_SIZE+1, "%s", p->alias2);
 		res++;
 	}
-	pw_thread_loop_unlock(c->context.loop);
+      done:
+	graph_release(c);
 
 	return res;
 }
@@ -3437,12 +6037,11 @@ int jack_port_disconnect (jack_client_t *client, jack_port_t *port)
 
 	pw_thread_loop_lock(c->context.loop);
 
-	spa_list_for_each(l, &c->context.links, link) {
-		if (l->port_link.src == o->id ||
-		    l->port_link.dst == o->id) {
-			pw_registry_proxy_destroy(c->registry_proxy, l->id);
-		}
-	}
+	spa_list_for_each(l, &o->port.src_links, port_link.src_link)
+		pw_registry_proxy_destroy(c->registry_proxy, l->id);
+	spa_list_for_each(l, &o->port.dst_links, port_link.dst_link)
+		pw_registry_proxy_destroy(c->registry_proxy, l->id);
+
 	res = do_sync(c);
 
 	pw_thread_loop_unlock(c->context.loop);
@@ -3468,7 +6067,7 @@ size_t jack_port_type_get_buffer_size (jack_client_t *client, const char *port_t
 	if (!strcmp(JACK_DEFAULT_AUDIO_TYPE, port_type))
 		return jack_get_buffer_size(client) * sizeof(float);
 	else if (!strcmp(JACK_DEFAULT_MIDI_TYPE, port_type))
-		return MAX_BUFFER_FRAMES * sizeof(float);
+		return midi_buffer_size((struct client *) client, 0);
 	else if (!strcmp(JACK_DEFAULT_VIDEO_TYPE, port_type))
 		return 320 * 240 * 4 * sizeof(float);
 	else
@@ -3546,17 +6145,29 @@ int jack_recompute_total_latency (jack_client_t *client, jack_port_t* port)
 	return 0;
 }
 
-static int port_compare_func(const void *v1, const void *v2)
+/* the listed ports of word @w that have all the indexed @flags */
+static inline uint64_t graph_flag_bits(const struct graph *g, unsigned long flags, uint32_t w)
 {
-	const struct object *const*o1 = v1, *const*o2 = v2;
-
-	if ((*o1)->port.type_id != (*o2)->port.type_id)
-		return (*o1)->port.type_id - (*o2)->port.type_id;
+	uint64_t bits = ~(uint64_t)0;
+	uint32_t i;
 
-	if ((*o1)->port.priority != (*o2)->port.priority)
-		return (*o2)->port.priority - (*o1)->port.priority;
+	for (i = 0; i < GRAPH_N_FLAGS; i++) {
+		if (flags & (1ul << i))
+			bits &= g->flag_bits[i * g->n_words + w];
+	}
+	return bits;
+}
 
-	return (*o1)->id - (*o2)->id;
+static bool port_matches(const struct graph_port *p, struct pattern *name,
+		unsigned long flags, uint32_t id)
+{
+	if (!SPA_FLAG_IS_SET(p->flags, flags))
+		return false;
+	if (id != SPA_ID_INVALID && p->node_id != id)
+		return false;
+	if (name != NULL && !pattern_match(name, p->name))
+		return false;
+	return true;
 }
 
 SPA_EXPORT
@@ -3566,72 +6177,97 @@ const char ** jack_get_ports (jack_client_t *client,
                               unsigned long flags)
 {
 	struct client *c = (struct client *) client;
-	const char **res;
-	struct object *o;
-	struct object *tmp[JACK_PORT_MAX];
+	const char **res = NULL;
+	const struct graph_port *p;
+	struct graph *g;
+	struct pattern *name = NULL, *type;
 	const char *str;
-	uint32_t i, count, id;
-	regex_t port_regex, type_regex;
+	uint32_t i, j, w, start, end, count = 0, id, types = 0;
+	uint64_t bits;
 
 	if ((str = getenv("PIPEWIRE_NODE")) != NULL)
 		id = pw_properties_parse_int(str);
 	else
 		id = SPA_ID_INVALID;
 
-	if (port_name_pattern && port_name_pattern[0])
-		regcomp(&port_regex, port_name_pattern, REG_EXTENDED | REG_NOSUB);
-	if (type_name_pattern && type_name_pattern[0])
-		regcomp(&type_regex, type_name_pattern, REG_EXTENDED | REG_NOSUB);
-
-	pw_thread_loop_lock(c->context.loop);
-
 	pw_log_debug(NAME" %p: ports id:%d name:%s type:%s flags:%08lx", c, id,
 			port_name_pattern, type_name_pattern, flags);
 
-	count = 0;
-	spa_list_for_each(o, &c->context.ports, link) {
-		pw_log_debug(NAME" %p: check port type:%d flags:%08lx name:%s", c,
-				o->port.type_id, o->port.flags, o->port.name);
-		if (count == JACK_PORT_MAX)
-			break;
-		if (o->port.type_id > 2)
-			continue;
-		if (!SPA_FLAG_IS_SET(o->port.flags, flags))
-			continue;
-		if (id != SPA_ID_INVALID && o->port.node_id != id)
-			continue;
+	/* before the pattern lock, this can take the thread loop lock */
+	g = graph_acquire(c);
+	pthread_mutex_lock(&c->context.pattern_lock);
+	if (g == NULL)
+		goto done;
 
-		if (port_name_pattern && port_name_pattern[0]) {
-			if (regexec(&port_regex, o->port.name, 0, NULL, 0) == REG_NOMATCH)
-				continue;
-		}
-		if (type_name_pattern && type_name_pattern[0]) {
-			if (regexec(&type_regex, type_to_string(o->port.type_id),
-						0, NULL, 0) == REG_NOMATCH)
-				continue;
-		}
+	if (port_name_pattern && port_name_pattern[0]) {
+		if ((name = find_pattern(c, port_name_pattern)) == NULL)
+			goto done;
+	}
+	if (type_name_pattern && type_name_pattern[0]) {
+		if ((type = find_pattern(c, type_name_pattern)) == NULL)
+			goto done;
+		for (i = 0; i < N_PORT_TYPES; i++)
+			if (pattern_match(type, type_to_string(i)))
+				types |= 1 << i;
+	} else {
+		types = (1 << N_PORT_TYPES) - 1;
+	}
+
+	if (name != NULL && name->type == PATTERN_EXACT) {
+		/* a full port name, use the name index */
+		p = graph_find_name(g, name->literal);
+		if (p == NULL || p - g->ports >= g->n_listed ||
+		    !(types & (1 << p->type_id)) ||
+		    !port_matches(p, NULL, flags, id))
+			goto done;
 
-		pw_log_debug(NAME" %p: port %s prio:%d matches (%d)",
-				c, o->port.name, o->port.priority, count);
-		tmp[count++] = o;
+		if ((res = malloc(sizeof(char*) * 2)) == NULL)
+			goto done;
+		res[count++] = p->object->port.name;
+		goto done;
 	}
-	if (count > 0) {
-		qsort(tmp, count, sizeof(struct object *), port_compare_func);
 
-		res = malloc(sizeof(char*) * (count + 1));
-		for (i = 0; i < count; i++)
-			res[i] = tmp[i]->port.name;
-		res[count] = NULL;
-	} else {
-		res = NULL;
+	if (g->n_listed == 0 ||
+	    (res = malloc(sizeof(char*) * (g->n_listed + 1))) == NULL)
+		goto done;
+
+	/* the graph is sorted, the result is in the right order. The flag
+	 * bitmaps skip the ports that don't have the flags 64 at a time. */
+	for (i = 0; i < N_PORT_TYPES; i++) {
+		if (!(types & (1 << i)))
+			continue;
+
+		start = g->type_offset[i];
+		end = g->type_offset[i + 1];
+		for (w = start / 64; w * 64 < end; w++) {
+			bits = graph_flag_bits(g, flags, w);
+			if (w == start / 64)
+				bits &= ~(uint64_t)0 << (start % 64);
+			if ((w + 1) * 64 > end)
+				bits &= ~(uint64_t)0 >> ((w + 1) * 64 - end);
+
+			for (; bits != 0; bits &= bits - 1) {
+				j = w * 64 + __builtin_ctzll(bits);
+				p = &g->ports[j];
+				if (!port_matches(p, name, flags, id))
+					continue;
+
+				pw_log_debug(NAME" %p: port %s matches (%d)", c, p->name, count);
+				/* the object outlives the graph */
+				res[count++] = p->object->port.name;
+			}
+		}
 	}
 
-	pw_thread_loop_unlock(c->context.loop);
+      done:
+	graph_release(c);
+	pthread_mutex_unlock(&c->context.pattern_lock);
 
-	if (port_name_pattern && port_name_pattern[0])
-		regfree(&port_regex);
-	if (type_name_pattern && type_name_pattern[0])
-		regfree(&type_regex);
+	if (count == 0) {
+		free(res);
+		return NULL;
+	}
+	res[count] = NULL;
 
 	return res;
 }
@@ -3640,13 +6276,14 @@ SPA_EXPORT
 jack_port_t * jack_port_by_name (jack_client_t *client, const char *port_name)
 {
 	struct client *c = (struct client *) client;
-	struct object *res;
-
-	pw_thread_loop_lock(c->context.loop);
-
-	res = find_port(c, port_name);
+	const struct graph_port *p;
+	struct graph *g;
+	struct object *res = NULL;
 
-	pw_thread_loop_unlock(c->context.loop);
+	if ((g = graph_acquire(c)) != NULL &&
+	    (p = graph_find_name(g, port_name)) != NULL)
+		res = p->object;
+	graph_release(c);
 
 	return (jack_port_t *)res;
 }
@@ -3656,20 +6293,27 @@ jack_port_t * jack_port_by_id (jack_client_t *client,
                                jack_port_id_t port_id)
 {
 	struct client *c = (struct client *) client;
+	const struct graph_port *p;
+	struct graph *g;
 	struct object *res = NULL, *o;
 
-	pw_thread_loop_lock(c->context.loop);
-
-	o = pw_map_lookup(&c->context.globals, port_id);
-	pw_log_debug(NAME" %p: port %d -> %p", c, port_id, o);
-
-	if (o == NULL || o->type != PW_TYPE_INTERFACE_Port)
-		goto exit;
-
-	res = o;
+	if ((g = graph_acquire(c)) != NULL &&
+	    (p = graph_find_id(g, port_id)) != NULL)
+		res = p->object;
+	graph_release(c);
+
+	/* removed ports are still found from the unregister callback. The
+	 * process thread can't take the lock, the protocol thread holds it
+	 * while it waits for the data loop */
+	if (res == NULL && rt_client != c) {
+		pw_thread_loop_lock(c->context.loop);
+		o = pw_map_lookup(&c->context.globals, port_id);
+		if (o != NULL && o->type == PW_TYPE_INTERFACE_Port)
+			res = o;
+		pw_thread_loop_unlock(c->context.loop);
+	}
 
-      exit:
-	pw_thread_loop_unlock(c->context.loop);
+	pw_log_debug(NAME" %p: port %d -> %p", c, port_id, res);
 
 	return (jack_port_t *)res;
 }
@@ -4039,20 +6683,37 @@ char *jack_client_get_uuid (jack_client_t *client)
 SPA_EXPORT
 int jack_client_real_time_priority (jack_client_t * client)
 {
-	return 20;
+	struct client *c = (struct client *) client;
+	return client_rt_priority(c);
 }
 
 SPA_EXPORT
 int jack_client_max_real_time_priority (jack_client_t *client)
 {
-	return 20;
+	struct client *c = (struct client *) client;
+	int priority;
+
+	/* other threads should not preempt the process thread */
+	if ((priority = client_rt_priority(c)) < 0)
+		return -1;
+	return SPA_MAX(priority - 1, sched_get_priority_min(c->rt_policy));
+}
+
+static int acquire_rt_scheduling(jack_native_thread_t thread, int policy, int priority)
+{
+	int res;
+
+	if ((res = set_rt_scheduling(thread, policy, priority)) < 0)
+		pw_log_warn("thread %lu: can't set priority %d: %s", thread, priority,
+				spa_strerror(res));
+	return res;
 }
 
+/* without a client, the thread gets the default policy */
 SPA_EXPORT
 int jack_acquire_real_time_scheduling (jack_native_thread_t thread, int priority)
 {
-	pw_log_warn("not implemented %lu %d", thread, priority);
-	return -ENOTSUP;
+	return acquire_rt_scheduling(thread, DEFAULT_RT_POLICY, priority);
 }
 
 /**
@@ -4079,18 +6740,90 @@ int jack_client_create_thread (jack_client_t* client,
                                void *(*start_routine)(void*),
                                void *arg)
 {
+	struct client *c = (struct client *) client;
+	int res;
+
 	if (globals.creator == NULL)
 		globals.creator = pthread_create;
 
-	pw_log_info("client %p: create thread", client);
-	return globals.creator(thread, NULL, start_routine, arg);
+	pw_log_info("client %p: create thread realtime:%d priority:%d", client,
+			realtime, priority);
+
+	if ((res = globals.creator(thread, NULL, start_routine, arg)) != 0)
+		return res;
+
+	if (realtime) {
+		if (c != NULL)
+			priority = SPA_MIN(priority, jack_client_max_real_time_priority(client));
+
+		/* when not allowed, the thread keeps running with the
+		 * normal scheduling */
+		if (priority < 0 ||
+		    acquire_rt_scheduling(*thread,
+				c ? c->rt_policy : DEFAULT_RT_POLICY, priority) < 0)
+			pw_log_warn("client %p: thread %lu not realtime", client, *thread);
+	}
+	if (c != NULL && c->have_rt_cpus)
+		set_affinity(*thread, realtime ? &c->rt_cpus : &c->other_cpus);
+
+	return 0;
+}
+
+SPA_EXPORT
+int jack_client_get_cpu_placement (const jack_client_t *client, int realtime,
+				   int *cpus, int max_cpus)
+{
+	const struct client *c = (const struct client *) client;
+	const cpu_set_t *set;
+	int i, n_cpus = 0;
+
+	if (c == NULL)
+		return -EINVAL;
+	if (!c->have_rt_cpus)
+		return 0;
+
+	set = realtime ? &c->rt_cpus : &c->other_cpus;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, set))
+			continue;
+		if (n_cpus < max_cpus)
+			cpus[n_cpus] = i;
+		n_cpus++;
+	}
+	return n_cpus;
+}
+
+SPA_EXPORT
+int jack_port_get_midi_stats (const jack_port_t *port, jack_midi_port_stats_t *stats)
+{
+	const struct object *o = (const struct object *) port;
+	struct port *p;
+
+	if (o == NULL || stats == NULL)
+		return -EINVAL;
+	if (o->type != PW_TYPE_INTERFACE_Port ||
+	    o->port.port_id == SPA_ID_INVALID ||
+	    o->port.type_id != 1)
+		return -EINVAL;
+
+	p = o->port.port;
+	*stats = p->midi_stats;
+	stats->buffer_size = p->midi_size;
+	return 0;
 }
 
 SPA_EXPORT
 int jack_drop_real_time_scheduling (jack_native_thread_t thread)
 {
-	pw_log_warn("not implemented %lu", thread);
-	return -ENOTSUP;
+	struct sched_param sp;
+	int res;
+
+	spa_zero(sp);
+	if ((res = pthread_setschedparam(thread, SCHED_OTHER, &sp)) != 0) {
+		pw_log_warn("thread %lu: can't drop realtime: %s", thread, strerror(res));
+		return -res;
+	}
+	return 0;
 }
 
 SPA_EXPORT
@@ -4145,6 +6878,7 @@ SPA_EXPORT
 uint32_t jack_midi_get_event_count(void* port_buffer)
 {
 	struct midi_buffer *mb = port_buffer;
+	midi_get_view(port_buffer);
 	return mb->event_count;
 }
 
@@ -4155,6 +6889,21 @@ int jack_midi_event_get(jack_midi_event_t *event,
 {
 	struct midi_buffer *mb = port_buffer;
 	struct midi_event *ev = SPA_MEMBER(mb, sizeof(*mb), struct midi_event);
+	struct midi_view *v;
+
+	if ((v = midi_get_view(port_buffer)) != NULL) {
+		struct spa_pod_control *c;
+
+		if (event_index >= v->mb.event_count)
+			return -ENODATA;
+
+		c = SPA_MEMBER(v->seq, v->index[event_index], struct spa_pod_control);
+		event->time = c->offset;
+		event->size = SPA_POD_BODY_SIZE(&c->value);
+		event->buffer = SPA_POD_BODY(&c->value);
+		return 0;
+	}
+
 	ev += event_index;
 	event->time = ev->time;
 	event->size = ev->size;
@@ -4166,6 +6915,13 @@ SPA_EXPORT
 void jack_midi_clear_buffer(void *port_buffer)
 {
 	struct midi_buffer *mb = port_buffer;
+	struct midi_view *v = port_buffer;
+
+	if (mb->magic == MIDI_VIEW_MAGIC && v->maxsize > 0) {
+		midi_encode_clear(v);
+		return;
+	}
+	mb->magic = MIDI_BUFFER_MAGIC;
 	mb->event_count = 0;
 	mb->write_pos = 0;
 	mb->lost_events = 0;
@@ -4183,6 +6939,13 @@ size_t jack_midi_max_event_size(void* port_buffer)
 	struct midi_buffer *mb = port_buffer;
 	size_t buffer_size = mb->buffer_size;
 
+	if (mb->magic == MIDI_VIEW_MAGIC) {
+		struct midi_view *v = port_buffer;
+		if (v->maxsize > 0)
+			return midi_encode_max_size(v);
+		midi_view_convert(v);
+	}
+
         /* (event_count + 1) below accounts for jack_midi_port_internal_event_t
          * which would be needed to store the next event */
         size_t used_size = sizeof(struct midi_buffer)
@@ -4199,6 +6962,59 @@ size_t jack_midi_max_event_size(void* port_buffer)
         }
 }
 
+static void midi_log(uint32_t type, void *port_buffer, uint64_t val1, uint64_t val2)
+{
+	struct rt_log_entry e = { type, 0, port_buffer, val1, val2 };
+
+	/* not called from a process thread */
+	if (rt_client == NULL)
+		rt_log_emit(NULL, &e, 0);
+	else
+		rt_log(rt_client, type, port_buffer, 0, val1, val2);
+}
+
+/* append a control to the outgoing sequence, with the same checks as the
+ * regular buffer */
+static jack_midi_data_t *midi_encode_reserve(struct midi_view *v,
+		jack_nframes_t time, size_t data_size)
+{
+	struct spa_pod_control *c;
+	uint32_t n = v->mb.event_count;
+
+	if (time >= v->mb.nframes) {
+		midi_log(RT_LOG_MIDI_TIME, v, time, v->mb.nframes);
+		goto failed;
+	}
+	if (n > 0 && time < SPA_MEMBER(v->seq, v->index[n - 1], struct spa_pod_control)->offset) {
+		midi_log(RT_LOG_MIDI_ORDER, v, time, n);
+		goto failed;
+	}
+	if (data_size <= 0) {
+		midi_log(RT_LOG_MIDI_SIZE, v, data_size, 0);
+		goto failed;
+	}
+	if (midi_encode_max_size(v) < data_size) {
+		midi_log(RT_LOG_MIDI_TOO_LARGE, v, data_size, 0);
+		goto failed;
+	}
+
+	c = SPA_MEMBER(v->seq, SPA_POD_SIZE(&v->seq->pod), struct spa_pod_control);
+	c->offset = time;
+	c->type = SPA_CONTROL_Midi;
+	c->value.type = SPA_TYPE_Bytes;
+	c->value.size = data_size;
+	v->seq->pod.size += SPA_ROUND_UP_N(sizeof(*c) + data_size, 8);
+	memset(SPA_MEMBER(c, sizeof(*c) + data_size, void), 0,
+			SPA_ROUND_UP_N(sizeof(*c) + data_size, 8) - sizeof(*c) - data_size);
+
+	v->index[n] = SPA_PTRDIFF(c, v->seq);
+	v->mb.event_count++;
+	return SPA_POD_BODY(&c->value);
+failed:
+	v->mb.lost_events++;
+	return NULL;
+}
+
 SPA_EXPORT
 jack_midi_data_t* jack_midi_event_reserve(void *port_buffer,
                         jack_nframes_t  time,
@@ -4208,22 +7024,30 @@ jack_midi_data_t* jack_midi_event_reserve(void *port_buffer,
 	struct midi_event *events = SPA_MEMBER(mb, sizeof(*mb), struct midi_event);
 	size_t buffer_size = mb->buffer_size;
 
+	if (mb->magic == MIDI_VIEW_MAGIC) {
+		struct midi_view *v = port_buffer;
+		if (v->maxsize > 0)
+			return midi_encode_reserve(v, time, data_size);
+		/* writing to an input buffer, make it a regular one first */
+		midi_view_convert(v);
+	}
+
 	if (time < 0 || time >= mb->nframes) {
-		pw_log_warn("midi %p: time:%d frames:%d", port_buffer, time, mb->nframes);
+		midi_log(RT_LOG_MIDI_TIME, port_buffer, time, mb->nframes);
 		goto failed;
 	}
 
 	if (mb->event_count > 0 && time < events[mb->event_count - 1].time) {
-		pw_log_warn("midi %p: time:%d ev:%d", port_buffer, time, mb->event_count);
+		midi_log(RT_LOG_MIDI_ORDER, port_buffer, time, mb->event_count);
 		goto failed;
 	}
 
 	/* Check if data_size is >0 and there is enough space in the buffer for the event. */
 	if (data_size <= 0) {
-		pw_log_warn("midi %p: data_size:%zd", port_buffer, data_size);
+		midi_log(RT_LOG_MIDI_SIZE, port_buffer, data_size, 0);
 		goto failed; // return NULL?
 	} else if (jack_midi_max_event_size (port_buffer) < data_size) {
-		pw_log_warn("midi %p: event too large: data_size:%zd", port_buffer, data_size);
+		midi_log(RT_LOG_MIDI_TOO_LARGE, port_buffer, data_size, 0);
 		goto failed;
 	} else {
 		struct midi_event *ev = &events[mb->event_count];
@@ -4265,6 +7089,7 @@ SPA_EXPORT
 uint32_t jack_midi_get_lost_event_count(void *port_buffer)
 {
 	struct midi_buffer *mb = port_buffer;
+	midi_get_view(port_buffer);
 	return mb->lost_events;
 }
 
@@ -0,0 +1,1345 @@
+/* PipeWire
+ * Copyright (C) 2019 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Tests of the internals of the JACK client that don't need a daemon. */
+
+#undef NDEBUG
+#include <assert.h>
+#include <sys/eventfd.h>
+
+#include "pipewire-jack.c"
+
+#define TEST_FRAMES		1024
+#define TEST_BUFFER_SIZE	(64 * 1024)
+#define TEST_MAX_INPUTS		8
+
+static void *test_alloc(size_t size)
+{
+	void *data = aligned_alloc(MAX_ALIGN, size);
+	assert(data != NULL);
+	memset(data, 0, size);
+	return data;
+}
+
+static void init_midi(void *data, size_t size)
+{
+	struct midi_buffer *mb = data;
+
+	mb->magic = MIDI_BUFFER_MAGIC;
+	mb->buffer_size = size;
+	mb->nframes = TEST_FRAMES;
+	mb->write_pos = 0;
+	mb->event_count = 0;
+	mb->lost_events = 0;
+}
+
+/* the events carry the input and their position in it */
+static struct spa_pod_sequence *make_sequence(void *data, size_t size,
+		const uint32_t *offsets, uint32_t n_events, uint8_t input)
+{
+	struct spa_pod_builder b = { 0, };
+	struct spa_pod_frame f;
+	uint32_t i;
+
+	spa_pod_builder_init(&b, data, size);
+	spa_pod_builder_push_sequence(&b, &f, 0);
+	for (i = 0; i < n_events; i++) {
+		uint8_t ev[3] = { 0x90, input, i };
+		spa_pod_builder_control(&b, offsets[i], SPA_CONTROL_Midi);
+		spa_pod_builder_bytes(&b, ev, sizeof(ev));
+	}
+	spa_pod_builder_pop(&b, &f);
+	return data;
+}
+
+/* many equal offsets within and across the inputs, the second input is
+ * empty when there are more than two */
+static void test_midi_merge(void)
+{
+	static const uint32_t offsets[] = { 0, 0, 3, 3, 3, 7, 7, 20 };
+	struct spa_pod_sequence *seq[TEST_MAX_INPUTS];
+	struct midi_cursor heap[TEST_MAX_INPUTS];
+	void *midi, *pods;
+	uint32_t n_seq, i, count, expected, size = TEST_BUFFER_SIZE / TEST_MAX_INPUTS;
+
+	midi = test_alloc(TEST_BUFFER_SIZE);
+	pods = test_alloc(TEST_BUFFER_SIZE);
+
+	for (n_seq = 0; n_seq <= TEST_MAX_INPUTS; n_seq++) {
+		jack_midi_event_t ev, prev = { 0, };
+
+		expected = 0;
+		for (i = 0; i < n_seq; i++) {
+			uint32_t n_events = (n_seq > 2 && i == 1) ? 0 : SPA_N_ELEMENTS(offsets) - i % 3;
+			seq[i] = make_sequence(SPA_MEMBER(pods, i * size, void), size,
+					offsets, n_events, i);
+			expected += n_events;
+		}
+
+		init_midi(midi, TEST_BUFFER_SIZE);
+		convert_to_midi(seq, n_seq, heap, midi);
+
+		count = jack_midi_get_event_count(midi);
+		assert(count == expected);
+		assert(jack_midi_get_lost_event_count(midi) == 0);
+
+		/* sorted on offset, then input, then position in the input */
+		for (i = 0; i < count; i++) {
+			assert(jack_midi_event_get(&ev, midi, i) == 0);
+			assert(ev.size == 3);
+			assert(ev.time == offsets[ev.buffer[2]]);
+			if (i > 0) {
+				assert(prev.time < ev.time ||
+				    (prev.time == ev.time && prev.buffer[1] < ev.buffer[1]) ||
+				    (prev.time == ev.time && prev.buffer[1] == ev.buffer[1] &&
+				     prev.buffer[2] < ev.buffer[2]));
+			}
+			prev = ev;
+		}
+	}
+	free(midi);
+	free(pods);
+}
+
+static void check_same_events(void *midi, void *ref)
+{
+	jack_midi_event_t ev, rev;
+	uint32_t i, count = jack_midi_get_event_count(ref);
+
+	assert(jack_midi_get_event_count(midi) == count);
+	assert(jack_midi_get_lost_event_count(midi) == jack_midi_get_lost_event_count(ref));
+
+	for (i = 0; i < count; i++) {
+		assert(jack_midi_event_get(&ev, midi, i) == 0);
+		assert(jack_midi_event_get(&rev, ref, i) == 0);
+		assert(ev.time == rev.time);
+		assert(ev.size == rev.size);
+		assert(memcmp(ev.buffer, rev.buffer, ev.size) == 0);
+	}
+}
+
+/* the view of an input sequence has the same events as a converted buffer,
+ * also when the index does not fit or the application writes to it */
+static void test_midi_view(void)
+{
+	/* one event after the cycle and one out of order are dropped */
+	static const uint32_t offsets[] = { 0, 5, 5, 9, TEST_FRAMES, 30, 40, 35 };
+	static const uint32_t short_offsets[] = { 0, 2, 2 };
+	static const uint8_t data[3] = { 0xb0, 0x07, 0x40 };
+	struct spa_pod_sequence *seq;
+	struct midi_cursor heap[1];
+	struct midi_view *v;
+	jack_midi_event_t ev;
+	void *midi, *ref, *pod;
+	uint32_t count;
+
+	midi = test_alloc(TEST_BUFFER_SIZE);
+	ref = test_alloc(TEST_BUFFER_SIZE);
+	pod = test_alloc(TEST_BUFFER_SIZE);
+	v = midi;
+
+	seq = make_sequence(pod, TEST_BUFFER_SIZE, offsets, SPA_N_ELEMENTS(offsets), 0);
+	init_midi(ref, TEST_BUFFER_SIZE);
+	convert_to_midi(&seq, 1, heap, ref);
+	assert(jack_midi_get_event_count(ref) == SPA_N_ELEMENTS(offsets) - 2);
+	assert(jack_midi_get_lost_event_count(ref) == 2);
+
+	init_midi(midi, TEST_BUFFER_SIZE);
+	midi_view_init(midi, seq);
+	check_same_events(midi, ref);
+	assert(v->mb.magic == MIDI_VIEW_MAGIC && v->indexed);
+
+	/* writing makes it a regular buffer with the same events */
+	count = jack_midi_get_event_count(ref);
+	assert(jack_midi_event_write(midi, 50, data, sizeof(data)) == 0);
+	assert(v->mb.magic == MIDI_BUFFER_MAGIC);
+	assert(jack_midi_get_event_count(midi) == count + 1);
+	assert(jack_midi_event_get(&ev, midi, count) == 0);
+	assert(ev.time == 50 && ev.size == sizeof(data));
+	assert(jack_midi_event_write(ref, 50, data, sizeof(data)) == 0);
+	check_same_events(midi, ref);
+
+	/* room for the index of two events, the third one converts the view */
+	seq = make_sequence(pod, TEST_BUFFER_SIZE, short_offsets, SPA_N_ELEMENTS(short_offsets), 0);
+	init_midi(ref, TEST_BUFFER_SIZE);
+	convert_to_midi(&seq, 1, heap, ref);
+
+	init_midi(midi, sizeof(struct midi_view) + 2 * sizeof(uint32_t));
+	assert(v->mb.buffer_size >= (int32_t) (sizeof(struct midi_buffer) +
+			SPA_N_ELEMENTS(short_offsets) * sizeof(struct midi_event)));
+	midi_view_init(midi, seq);
+	check_same_events(midi, ref);
+	assert(v->mb.magic == MIDI_BUFFER_MAGIC);
+
+	free(midi);
+	free(ref);
+	free(pod);
+}
+
+/* jack_midi_event_write() on an output port encodes the sequence that
+ * convert_from_midi() makes of a regular buffer, with the same checks */
+static void test_midi_encode(void)
+{
+	static const uint8_t sysex[10] = { 0xf0, 1, 2, 3, 4, 5, 6, 7, 8, 0xf7 };
+	static const uint8_t note[3] = { 0x90, 0x40, 0x7f };
+	static const uint8_t clock[1] = { 0xf8 };
+	static const struct {
+		uint32_t time;
+		const uint8_t *data;
+		size_t size;
+	} events[] = {
+		{ 0, note, sizeof(note) },
+		{ 0, clock, sizeof(clock) },
+		{ 10, sysex, sizeof(sysex) },
+		{ 5, note, sizeof(note) },		/* out of order */
+		{ 10, note, 0 },			/* empty */
+		{ TEST_FRAMES, note, sizeof(note) },	/* after the cycle */
+		{ 11, sysex, sizeof(sysex) },
+		{ TEST_FRAMES - 1, clock, sizeof(clock) },
+	};
+	struct spa_pod_sequence *seq;
+	jack_midi_data_t *d;
+	void *midi, *ref, *pod, *ref_pod;
+	uint32_t i;
+
+	midi = test_alloc(TEST_BUFFER_SIZE);
+	ref = test_alloc(TEST_BUFFER_SIZE);
+	pod = test_alloc(TEST_BUFFER_SIZE);
+	ref_pod = test_alloc(TEST_BUFFER_SIZE);
+
+	init_midi(midi, TEST_BUFFER_SIZE);
+	midi_encode_init(midi, pod, TEST_BUFFER_SIZE);
+	init_midi(ref, TEST_BUFFER_SIZE);
+
+	for (i = 0; i < SPA_N_ELEMENTS(events); i++) {
+		assert(jack_midi_event_write(midi, events[i].time, events[i].data, events[i].size) ==
+		       jack_midi_event_write(ref, events[i].time, events[i].data, events[i].size));
+	}
+	d = jack_midi_event_reserve(midi, TEST_FRAMES - 1, sizeof(note));
+	assert(d != NULL);
+	memcpy(d, note, sizeof(note));
+	assert(jack_midi_event_write(ref, TEST_FRAMES - 1, note, sizeof(note)) == 0);
+
+	check_same_events(midi, ref);
+	assert(jack_midi_get_lost_event_count(midi) == 3);
+
+	convert_from_midi(ref, ref_pod, TEST_BUFFER_SIZE);
+	seq = pod;
+	assert(SPA_POD_SIZE(&seq->pod) == SPA_POD_SIZE((struct spa_pod *) ref_pod));
+	assert(memcmp(pod, ref_pod, SPA_POD_SIZE(&seq->pod)) == 0);
+
+	jack_midi_clear_buffer(midi);
+	assert(jack_midi_get_event_count(midi) == 0);
+	assert(seq->pod.size == sizeof(struct spa_pod_sequence_body));
+
+	/* two events fill 64 bytes, the third one is lost */
+	midi_encode_init(midi, pod, 64);
+	for (i = 0; i < 3; i++)
+		jack_midi_event_write(midi, i, note, sizeof(note));
+	assert(jack_midi_get_event_count(midi) == 2);
+	assert(jack_midi_get_lost_event_count(midi) == 1);
+	assert(SPA_POD_SIZE(&seq->pod) <= 64);
+
+	midi_encode_done(midi);
+	assert(((struct midi_buffer *) midi)->magic == MIDI_BUFFER_MAGIC);
+
+	free(midi);
+	free(ref);
+	free(pod);
+	free(ref_pod);
+}
+
+/* a client with what the registry and the port functions use, without
+ * a connection */
+static struct client *test_client_new(void)
+{
+	struct client *c;
+	uint32_t i;
+
+	c = calloc(1, sizeof(struct client));
+	assert(c != NULL);
+
+	c->node_id = SPA_ID_INVALID;
+	snprintf(c->name, sizeof(c->name), "test");
+	c->max_frames = DEFAULT_MAX_BUFFER_FRAMES;
+	c->quantum = DEFAULT_BUFFER_FRAMES;
+
+	c->context.main = pw_main_loop_new(NULL);
+	c->context.loop = pw_thread_loop_new(pw_main_loop_get_loop(c->context.main), "test");
+	spa_list_init(&c->context.free_objects);
+	spa_list_init(&c->context.nodes);
+	spa_list_init(&c->context.ports);
+	spa_list_init(&c->context.links);
+	spa_list_init(&c->context.pending_src_links);
+	spa_list_init(&c->context.pending_dst_links);
+	spa_list_init(&c->context.graph_retired);
+	pthread_mutex_init(&c->context.pattern_lock, NULL);
+	c->context.batch_event = pw_loop_add_event(
+			pw_thread_loop_get_loop(c->context.loop),
+			on_batch_event, c);
+	pw_array_init(&c->notify_pending, 64 * sizeof(struct notification));
+	pthread_mutex_init(&c->notify_lock, NULL);
+	spa_list_init(&c->notify_batches);
+	c->notify_loop = pw_loop_new(NULL);
+	assert(c->notify_loop != NULL);
+	c->notify_event = pw_loop_add_event(c->notify_loop, on_notify_event, c);
+	c->rt_log_event = pw_loop_add_event(c->notify_loop, on_rt_log_event, c);
+	c->rt_log_timer = pw_loop_add_timer(c->notify_loop, on_rt_log_timeout, c);
+	for (i = 0; i < N_PORT_TYPES; i++)
+		pw_array_init(&c->context.port_index[i], 64 * sizeof(struct object *));
+	pw_map_init(&c->context.globals, 64, 64);
+
+	/* the data loop is not started, invokes run right away */
+	c->loop = pw_data_loop_new(NULL);
+	assert(c->loop != NULL);
+	pw_array_init(&c->links, 64);
+	pw_array_init(&c->slabs, 16 * sizeof(struct slab));
+	spa_list_init(&c->free_mix);
+	init_port_pool(c, SPA_DIRECTION_INPUT);
+	init_port_pool(c, SPA_DIRECTION_OUTPUT);
+	spa_list_init(&c->midi_outputs);
+
+	return c;
+}
+
+static void test_client_free(struct client *c)
+{
+	struct notification *n;
+	struct notify_batch *b;
+	uint32_t i;
+
+	c->destroyed = true;
+	pw_loop_destroy_source(pw_thread_loop_get_loop(c->context.loop),
+			c->context.batch_event);
+	pw_loop_destroy_source(c->notify_loop, c->notify_event);
+	pw_loop_destroy_source(c->notify_loop, c->rt_log_event);
+	pw_loop_destroy_source(c->notify_loop, c->rt_log_timer);
+	pw_loop_destroy(c->notify_loop);
+	spa_list_consume(b, &c->notify_batches, link) {
+		spa_list_remove(&b->link);
+		free_batch(c, b);
+	}
+	pthread_mutex_destroy(&c->notify_lock);
+	pw_thread_loop_destroy(c->context.loop);
+	pw_main_loop_destroy(c->context.main);
+	pw_data_loop_destroy(c->loop);
+
+	object_hash_clear(&c->context.port_names);
+	object_hash_clear(&c->context.link_ports);
+	for (i = 0; i < N_PORT_TYPES; i++)
+		pw_array_clear(&c->context.port_index[i]);
+	pw_map_clear(&c->context.globals);
+	clear_patterns(c);
+	pthread_mutex_destroy(&c->context.pattern_lock);
+	graph_clear(c);
+	free(c->signals);
+	pw_array_for_each(n, &c->notify_pending) {
+		free(n->old_name);
+		free(n->new_name);
+	}
+	pw_array_clear(&c->notify_pending);
+	pw_array_clear(&c->links);
+	pw_array_clear(&c->port_pool[SPA_DIRECTION_INPUT]);
+	pw_array_clear(&c->port_pool[SPA_DIRECTION_OUTPUT]);
+	free_slabs(c);
+	free(c);
+}
+
+static void registry_add_node(struct client *c, uint32_t id, const char *name, int priority)
+{
+	struct spa_dict_item items[2];
+	char prio[16];
+
+	snprintf(prio, sizeof(prio), "%d", priority);
+	items[0] = SPA_DICT_ITEM_INIT(PW_KEY_NODE_NAME, name);
+	items[1] = SPA_DICT_ITEM_INIT(PW_KEY_PRIORITY_MASTER, prio);
+	registry_event_global(c, id, 0, PW_TYPE_INTERFACE_Node, 0,
+			&SPA_DICT_INIT_ARRAY(items));
+}
+
+static void registry_add_port(struct client *c, uint32_t id, uint32_t node_id,
+		const char *name, const char *type, const char *direction)
+{
+	struct spa_dict_item items[4];
+	char node[16];
+
+	snprintf(node, sizeof(node), "%u", node_id);
+	items[0] = SPA_DICT_ITEM_INIT(PW_KEY_FORMAT_DSP, type);
+	items[1] = SPA_DICT_ITEM_INIT(PW_KEY_NODE_ID, node);
+	items[2] = SPA_DICT_ITEM_INIT(PW_KEY_PORT_NAME, name);
+	items[3] = SPA_DICT_ITEM_INIT(PW_KEY_PORT_DIRECTION, direction);
+	registry_event_global(c, id, 0, PW_TYPE_INTERFACE_Port, 0,
+			&SPA_DICT_INIT_ARRAY(items));
+}
+
+static void registry_add_link(struct client *c, uint32_t id, uint32_t src, uint32_t dst)
+{
+	struct spa_dict_item items[2];
+	char out[16], in[16];
+
+	snprintf(out, sizeof(out), "%u", src);
+	snprintf(in, sizeof(in), "%u", dst);
+	items[0] = SPA_DICT_ITEM_INIT(PW_KEY_LINK_OUTPUT_PORT, out);
+	items[1] = SPA_DICT_ITEM_INIT(PW_KEY_LINK_INPUT_PORT, in);
+	registry_event_global(c, id, 0, PW_TYPE_INTERFACE_Link, 0,
+			&SPA_DICT_INIT_ARRAY(items));
+}
+
+/* renames the object like jack_port_rename() */
+static void rename_port(struct client *c, struct object *o, const char *name)
+{
+	port_name_remove(c, o);
+	snprintf(o->port.name, sizeof(o->port.name), "%s", name);
+	port_name_insert(c, o);
+}
+
+#define TEST_N_PORTS	200
+
+/* enough ports to grow the name table, a rename and the removal of half
+ * of the ports */
+static void test_port_names(void)
+{
+	struct client *c = test_client_new();
+	struct object *o;
+	char name[64];
+	uint32_t i;
+
+	registry_add_node(c, 1, "sys", 0);
+	for (i = 0; i < TEST_N_PORTS; i++) {
+		snprintf(name, sizeof(name), "out_%u", i);
+		registry_add_port(c, 10 + i, 1, name, JACK_DEFAULT_AUDIO_TYPE, "out");
+	}
+	assert(c->context.port_names.n_objects == TEST_N_PORTS);
+	assert(c->context.port_names.size > OBJECT_HASH_MIN_SIZE);
+
+	for (i = 0; i < TEST_N_PORTS; i++) {
+		snprintf(name, sizeof(name), "sys/1:out_%u", i);
+		assert((o = find_port(c, name)) != NULL);
+		assert(o->id == 10 + i);
+	}
+	assert(find_port(c, "sys/1:out_200") == NULL);
+	assert(find_port(c, "sys/1:out_") == NULL);
+
+	o = find_port(c, "sys/1:out_7");
+	rename_port(c, o, "sys/1:renamed");
+	assert(find_port(c, "sys/1:out_7") == NULL);
+	assert(find_port(c, "sys/1:renamed") == o);
+
+	for (i = 0; i < TEST_N_PORTS; i += 2)
+		registry_event_global_remove(c, 10 + i);
+	assert(c->context.port_names.n_objects == TEST_N_PORTS / 2);
+
+	for (i = 0; i < TEST_N_PORTS; i++) {
+		snprintf(name, sizeof(name), "sys/1:out_%u", i);
+		o = find_port(c, name);
+		assert((o != NULL) == (i % 2 == 1 && i != 7));
+	}
+	assert(find_port(c, "sys/1:renamed") != NULL);
+
+	/* a removed name can come back */
+	registry_add_port(c, 10 + TEST_N_PORTS, 1, "out_0", JACK_DEFAULT_AUDIO_TYPE, "out");
+	assert((o = find_port(c, "sys/1:out_0")) != NULL);
+	assert(o->id == 10 + TEST_N_PORTS);
+
+	test_client_free(c);
+}
+
+static uint32_t count_links(struct object *o)
+{
+	struct object *l;
+	uint32_t count = 0;
+
+	spa_list_for_each(l, &o->port.src_links, port_link.src_link)
+		count++;
+	spa_list_for_each(l, &o->port.dst_links, port_link.dst_link)
+		count++;
+	return count;
+}
+
+#define TEST_N_LINKS	100
+
+/* one output to all inputs and each output to its input, with a rename,
+ * the removal of links, the removal of a port before its links and a link
+ * before its ports */
+static void test_links(void)
+{
+	struct client *c = test_client_new();
+	struct object *src, *dst, *l;
+	char name[64];
+	uint32_t i;
+
+	registry_add_node(c, 1, "sys", 0);
+	registry_add_node(c, 2, "app", 0);
+	for (i = 0; i < TEST_N_LINKS; i++) {
+		snprintf(name, sizeof(name), "out_%u", i);
+		registry_add_port(c, 10 + i, 1, name, JACK_DEFAULT_AUDIO_TYPE, "out");
+		snprintf(name, sizeof(name), "in_%u", i);
+		registry_add_port(c, 1000 + i, 2, name, JACK_DEFAULT_AUDIO_TYPE, "in");
+	}
+	for (i = 0; i < TEST_N_LINKS; i++) {
+		registry_add_link(c, 2000 + i, 10 + i, 1000 + i);
+		if (i > 0)
+			registry_add_link(c, 3000 + i, 10, 1000 + i);
+	}
+	assert(c->context.link_ports.n_objects == 2 * TEST_N_LINKS - 1);
+
+	for (i = 0; i < TEST_N_LINKS; i++) {
+		assert((l = find_link(c, 10 + i, 1000 + i)) != NULL);
+		assert(l->id == 2000 + i);
+		assert(find_link(c, 1000 + i, 10 + i) == NULL);
+		if (i > 1)
+			assert(find_link(c, 11, 1000 + i) == NULL);
+	}
+	src = pw_map_lookup(&c->context.globals, 10);
+	dst = pw_map_lookup(&c->context.globals, 1005);
+	assert(count_links(src) == TEST_N_LINKS);
+	assert(count_links(dst) == 2);
+
+	/* links are on the ids */
+	rename_port(c, src, "sys/1:renamed");
+	assert(find_link(c, 10, 1005) != NULL);
+
+	registry_event_global_remove(c, 3005);
+	assert(find_link(c, 10, 1005) == NULL);
+	assert(find_link(c, 15, 1005) != NULL);
+	assert(count_links(src) == TEST_N_LINKS - 1);
+	assert(count_links(dst) == 1);
+
+	/* the port goes first, its links later */
+	registry_event_global_remove(c, 1006);
+	assert(find_link(c, 10, 1006) != NULL);
+	assert(count_links(src) == TEST_N_LINKS - 1);
+	registry_event_global_remove(c, 3006);
+	registry_event_global_remove(c, 2006);
+	assert(find_link(c, 10, 1006) == NULL);
+	assert(find_link(c, 16, 1006) == NULL);
+	assert(count_links(src) == TEST_N_LINKS - 2);
+	assert(c->context.link_ports.n_objects == 2 * TEST_N_LINKS - 4);
+
+	/* a link that comes before its ports */
+	registry_add_link(c, 5, 4000, 4001);
+	assert(find_link(c, 4000, 4001) != NULL);
+	registry_add_port(c, 4000, 1, "late_out", JACK_DEFAULT_AUDIO_TYPE, "out");
+	registry_add_port(c, 4001, 2, "late_in", JACK_DEFAULT_AUDIO_TYPE, "in");
+	assert(count_links(pw_map_lookup(&c->context.globals, 4000)) == 1);
+	assert(count_links(pw_map_lookup(&c->context.globals, 4001)) == 1);
+	assert(jack_port_connected_to(pw_map_lookup(&c->context.globals, 4001),
+				"sys/1:late_out") == 1);
+	assert(spa_list_is_empty(&c->context.pending_src_links));
+	assert(spa_list_is_empty(&c->context.pending_dst_links));
+
+	test_client_free(c);
+}
+
+/* the queries answer from the published graph, which is built again when
+ * a reader comes after a change, and the retired graphs are freed when the
+ * last reader is done */
+static void test_graph(void)
+{
+	struct client *c = test_client_new();
+	jack_client_t *client = (jack_client_t *) c;
+	jack_port_t *in, *out;
+	const char **names, *peers[1];
+	struct graph *g;
+
+	registry_add_node(c, 1, "sys", 0);
+	registry_add_node(c, 2, "app", 0);
+	registry_add_port(c, 10, 1, "out_0", JACK_DEFAULT_AUDIO_TYPE, "out");
+	registry_add_port(c, 11, 1, "out_1", JACK_DEFAULT_AUDIO_TYPE, "out");
+	registry_add_port(c, 20, 2, "in_0", JACK_DEFAULT_AUDIO_TYPE, "in");
+	registry_add_link(c, 30, 10, 20);
+	registry_add_link(c, 31, 11, 20);
+	assert(c->context.graph == NULL);
+
+	in = jack_port_by_name(client, "app/2:in_0");
+	out = jack_port_by_name(client, "sys/1:out_1");
+	assert(in == pw_map_lookup(&c->context.globals, 20));
+	assert(out == pw_map_lookup(&c->context.globals, 11));
+	assert(jack_port_by_id(client, 10) == pw_map_lookup(&c->context.globals, 10));
+
+	names = jack_port_get_all_connections(client, in);
+	assert(names != NULL);
+	assert(!strcmp(names[0], "sys/1:out_0"));
+	assert(!strcmp(names[1], "sys/1:out_1"));
+	assert(names[2] == NULL);
+	free(names);
+	assert(jack_port_get_all_connections_noalloc(client, in, peers, 1) == 2);
+	assert(!strcmp(peers[0], "sys/1:out_0"));
+	assert(jack_port_connected_to(in, "sys/1:out_1") == 1);
+	assert(jack_port_connected_to(out, "app/2:in_0") == 1);
+	assert(jack_port_connected_to(in, "app/2:in_0") == 0);
+
+	/* the graph has its own copy of the names */
+	g = c->context.graph;
+	rename_port(c, (struct object *) out, "sys/1:renamed");
+	assert(!strcmp(graph_find_id(g, 11)->name, "sys/1:out_1"));
+	assert(jack_port_by_name(client, "sys/1:renamed") == out);
+	assert(c->context.graph != g);
+	assert(jack_port_by_name(client, "sys/1:out_1") == NULL);
+	assert(jack_port_connected_to(in, "sys/1:renamed") == 1);
+
+	registry_event_global_remove(c, 30);
+	registry_event_global_remove(c, 10);
+	assert(jack_port_by_name(client, "sys/1:out_0") == NULL);
+	assert(jack_port_connected_to(in, "sys/1:out_0") == 0);
+	names = jack_port_get_all_connections(client, in);
+	assert(names != NULL);
+	assert(!strcmp(names[0], "sys/1:renamed"));
+	assert(names[1] == NULL);
+	free(names);
+
+	/* a reader keeps the graph it has */
+	g = graph_acquire(c);
+	registry_add_port(c, 12, 1, "out_2", JACK_DEFAULT_AUDIO_TYPE, "out");
+	assert(jack_port_by_id(client, 12) != NULL);
+	assert(c->context.graph != g);
+	assert(c->context.graph_n_retired == 1);
+	assert(graph_find_id(g, 11) != NULL);
+	assert(graph_find_id(g, 12) == NULL);
+	graph_release(c);
+
+	/* the release signals the batch event, run it like the loop would */
+	on_batch_event(c, 1);
+	assert(c->context.graph_n_retired == 0);
+	assert(spa_list_is_empty(&c->context.graph_retired));
+
+	/* the process thread asks the protocol loop for the new graph */
+	g = c->context.graph;
+	registry_add_port(c, 13, 1, "out_3", JACK_DEFAULT_AUDIO_TYPE, "out");
+	rt_client = c;
+	assert(jack_port_by_name(client, "sys/1:out_3") == NULL);
+	assert(c->context.graph == g);
+	assert(c->context.graph_wanted);
+	on_batch_event(c, 1);
+	assert(!c->context.graph_wanted);
+	assert(jack_port_by_name(client, "sys/1:out_3") != NULL);
+	rt_client = NULL;
+
+	test_client_free(c);
+}
+
+static uint32_t removed_id;
+static bool removed_found;
+
+static void on_port_registration(jack_port_id_t id, int reg, void *arg)
+{
+	jack_port_t *port;
+
+	if (reg)
+		return;
+	port = jack_port_by_id(arg, id);
+	removed_id = id;
+	removed_found = port != NULL &&
+		!strcmp(jack_port_name(port), "sys/1:gone") &&
+		!strcmp(jack_port_type(port), JACK_DEFAULT_MIDI_TYPE);
+}
+
+/* the object of a removed port is not reused before the callback of the
+ * removal ran, which can still look it up */
+static void test_removed_port(void)
+{
+	struct client *c = test_client_new();
+	struct object *o, *n;
+
+	c->portregistration_callback = on_port_registration;
+	c->portregistration_arg = c;
+
+	registry_add_node(c, 1, "sys", 0);
+	registry_add_port(c, 10, 1, "gone", JACK_DEFAULT_MIDI_TYPE, "out");
+	o = pw_map_lookup(&c->context.globals, 10);
+	on_batch_event(c, 1);
+	on_notify_event(c, 1);
+
+	registry_event_global_remove(c, 10);
+	assert(o->refs == 1 && o->removed);
+	/* new objects don't take its place */
+	registry_add_port(c, 11, 1, "new", JACK_DEFAULT_AUDIO_TYPE, "out");
+	n = pw_map_lookup(&c->context.globals, 11);
+	assert(n != o);
+
+	on_batch_event(c, 1);
+	on_notify_event(c, 1);
+	assert(removed_id == 10);
+	assert(removed_found);
+	assert(o->refs == 0 && !o->removed);
+	assert(c->context.free_objects.prev == &o->link);
+
+	test_client_free(c);
+}
+
+static void check_ports(struct client *c, const char *name_pattern,
+		const char *type_pattern, unsigned long flags, const char **expected)
+{
+	const char **ports;
+	uint32_t i;
+
+	ports = jack_get_ports((jack_client_t *) c, name_pattern, type_pattern, flags);
+	if (expected[0] == NULL) {
+		assert(ports == NULL);
+		return;
+	}
+	assert(ports != NULL);
+	for (i = 0; expected[i] != NULL; i++) {
+		assert(ports[i] != NULL);
+		assert(!strcmp(ports[i], expected[i]));
+	}
+	assert(ports[i] == NULL);
+	free(ports);
+}
+
+/* jack_get_ports() lists audio, then MIDI, then video, each on node
+ * priority, highest first, and then on id, whatever order they came in */
+static void test_get_ports(void)
+{
+	struct client *c = test_client_new();
+	const char **ports;
+	char name[16];
+	uint32_t i;
+
+	registry_add_node(c, 1, "low", 0);
+	registry_add_node(c, 2, "high", 10);
+	registry_add_port(c, 50, 1, "a50", JACK_DEFAULT_AUDIO_TYPE, "out");
+	registry_add_port(c, 45, 1, "m45", JACK_DEFAULT_MIDI_TYPE, "in");
+	registry_add_port(c, 40, 2, "a40", JACK_DEFAULT_AUDIO_TYPE, "in");
+	registry_add_port(c, 60, 2, "a60", JACK_DEFAULT_AUDIO_TYPE, "out");
+	registry_add_port(c, 55, 2, "o55", "other", "out");
+	registry_add_port(c, 35, 2, "m35", JACK_DEFAULT_MIDI_TYPE, "out");
+	registry_add_port(c, 30, 1, "a30", JACK_DEFAULT_AUDIO_TYPE, "in");
+
+	check_ports(c, NULL, NULL, 0, (const char *[]) {
+			"high/2:a40", "high/2:a60", "low/1:a30", "low/1:a50",
+			"high/2:m35", "low/1:m45", NULL });
+	check_ports(c, NULL, JACK_DEFAULT_MIDI_TYPE, 0, (const char *[]) {
+			"high/2:m35", "low/1:m45", NULL });
+	check_ports(c, NULL, NULL, JackPortIsInput, (const char *[]) {
+			"high/2:a40", "low/1:a30", "low/1:m45", NULL });
+	check_ports(c, "low", NULL, 0, (const char *[]) {
+			"low/1:a30", "low/1:a50", "low/1:m45", NULL });
+	check_ports(c, ":a.0$", "audio", JackPortIsOutput, (const char *[]) {
+			"high/2:a60", "low/1:a50", NULL });
+	check_ports(c, "^low/1:a50$", NULL, 0, (const char *[]) {
+			"low/1:a50", NULL });
+	check_ports(c, "^high/2:o55$", NULL, 0, (const char *[]) { NULL });
+
+	/* removed and added ports keep the order */
+	registry_event_global_remove(c, 40);
+	registry_add_port(c, 20, 1, "a20", JACK_DEFAULT_AUDIO_TYPE, "in");
+	registry_add_port(c, 70, 2, "a70", JACK_DEFAULT_AUDIO_TYPE, "in");
+
+	check_ports(c, NULL, JACK_DEFAULT_AUDIO_TYPE, 0, (const char *[]) {
+			"high/2:a60", "high/2:a70", "low/1:a20", "low/1:a30", "low/1:a50", NULL });
+
+	/* the flag bitmaps over more than one word, with the midi ports
+	 * after the audio ports in the same word */
+	registry_add_node(c, 3, "many", 5);
+	for (i = 0; i < 150; i++) {
+		snprintf(name, sizeof(name), "p%03u", i);
+		registry_add_port(c, 100 + i, 3, name, JACK_DEFAULT_AUDIO_TYPE,
+				i % 3 == 0 ? "out" : "in");
+	}
+	assert((ports = jack_get_ports((jack_client_t *) c, NULL, NULL,
+					JackPortIsOutput)) != NULL);
+	assert(strcmp(ports[0], "high/2:a60") == 0);
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "many/3:p%03u", i * 3);
+		assert(strcmp(ports[i + 1], name) == 0);
+	}
+	assert(strcmp(ports[51], "low/1:a50") == 0);
+	assert(strcmp(ports[52], "high/2:m35") == 0);
+	assert(ports[53] == NULL);
+	free(ports);
+
+	check_ports(c, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, (const char *[]) {
+			"low/1:m45", NULL });
+	check_ports(c, NULL, NULL, JackPortIsInput | JackPortIsOutput,
+			(const char *[]) { NULL });
+
+	test_client_free(c);
+}
+
+/* a connection to an input port that has one buffer with data */
+static struct mix *add_input_mix(struct client *c, struct port *p, uint32_t mix_id,
+		struct spa_io_buffers *io, float *data)
+{
+	struct mix *mix;
+
+	assert((mix = ensure_mix(c, p, mix_id)) != NULL);
+	io->status = SPA_STATUS_HAVE_DATA;
+	io->buffer_id = 0;
+	mix->io = io;
+	mix->buffers[0].id = 0;
+	mix->buffers[0].n_datas = 1;
+	mix->buffers[0].datas[0].data = data;
+	mix->n_buffers = 1;
+	return mix;
+}
+
+static void fill(float *data, uint32_t n_samples, float val)
+{
+	uint32_t i;
+	for (i = 0; i < n_samples; i++)
+		data[i] = val;
+}
+
+static bool all_equal(const float *data, uint32_t n_samples, float val)
+{
+	uint32_t i;
+	for (i = 0; i < n_samples; i++)
+		if (data[i] != val)
+			return false;
+	return true;
+}
+
+#define MIX_MAX_SRC	8
+#define MIX_MAX_OFFSET	16
+#define MIX_GUARD	-7.0f
+
+/* normal values with denormals in between, that FTZ and DAZ change */
+static void fill_mix_input(float *data, uint32_t n_samples, uint32_t seed)
+{
+	uint32_t i;
+	for (i = 0; i < n_samples; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (float)(int32_t)(seed >> 8) / (float)(1 << 23);
+		if (seed & (1 << 4))
+			data[i] *= 1e-38f;
+	}
+}
+
+/* run a mix function on all the combinations of alignments, sizes and
+ * inputs and compare to the C function, the sums are done in the same order
+ * so the results are the same to the bit */
+static void check_mix_func(const struct mix_info *info)
+{
+	static const uint32_t sizes[] = { 0, 1, 3, 15, 16, 17, 63, 64, 65, 129, 1024 };
+	static const uint32_t n_srcs[] = { 0, 1, 2, 3, MIX_MAX_SRC };
+	uint32_t len = 1024 + MIX_MAX_OFFSET * 2;
+	float *in[MIX_MAX_SRC], *out, *ref;
+	const float *src[MIX_MAX_SRC];
+	uint32_t i, j, k, off, n;
+
+	for (i = 0; i < MIX_MAX_SRC; i++) {
+		in[i] = test_alloc(len * sizeof(float));
+		fill_mix_input(in[i], len, i + 1);
+	}
+	out = test_alloc(len * sizeof(float));
+	ref = test_alloc(len * sizeof(float));
+
+	for (i = 0; i < SPA_N_ELEMENTS(n_srcs); i++) {
+		for (j = 0; j < SPA_N_ELEMENTS(sizes); j++) {
+			for (off = 0; off < MIX_MAX_OFFSET; off++) {
+				n = sizes[j];
+				/* every input gets another alignment */
+				for (k = 0; k < n_srcs[i]; k++)
+					src[k] = in[k] + (off * (k + 1) + k) % MIX_MAX_OFFSET;
+
+				mix_f32_c(ref, src, n_srcs[i], n);
+				fill(out, len, MIX_GUARD);
+				info->func(out + off, src, n_srcs[i], n);
+
+				if (memcmp(out + off, ref, n * sizeof(float)) != 0) {
+					fprintf(stderr, "mix %s: n_src:%u n_samples:%u offset:%u differs\n",
+							info->name, n_srcs[i], n, off);
+					assert(false);
+				}
+				/* the head and tail around dst are left alone */
+				assert(all_equal(out, off, MIX_GUARD));
+				assert(all_equal(out + off + n, len - off - n, MIX_GUARD));
+			}
+		}
+	}
+
+	for (i = 0; i < MIX_MAX_SRC; i++)
+		free(in[i]);
+	free(out);
+	free(ref);
+}
+
+static uint32_t test_cpu_flags(void)
+{
+	uint32_t flags = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse"))
+		flags |= SPA_CPU_FLAG_SSE;
+	if (__builtin_cpu_supports("avx"))
+		flags |= SPA_CPU_FLAG_AVX;
+	if (__builtin_cpu_supports("avx512f"))
+		flags |= SPA_CPU_FLAG_AVX512;
+#endif
+	return flags;
+}
+
+/* every mix function that this CPU can run, with and without FTZ and DAZ */
+static void test_mix_functions(void)
+{
+	const struct mix_info *info;
+	uint32_t flags = test_cpu_flags();
+#if defined(__SSE__)
+	uint32_t csr = __builtin_ia32_stmxcsr();
+#endif
+
+	/* the table is sorted best first, leave out the flags of each
+	 * function to get to the next one */
+	do {
+		assert((info = mix_find_info(flags)) != NULL);
+		check_mix_func(info);
+#if defined(__SSE__)
+		flush_denormals();
+		check_mix_func(info);
+		__builtin_ia32_ldmxcsr(csr);
+#endif
+		flags &= ~info->cpu_flags;
+	} while (info->cpu_flags != 0);
+
+	assert(strcmp(info->name, "c") == 0);
+}
+
+/* the inputs are mixed once per cycle, unless more frames are asked for or
+ * the connections change */
+static void test_buffer_cache(void)
+{
+	struct client *c = test_client_new();
+	struct spa_io_buffers io[3];
+	jack_port_t *port;
+	struct port *p;
+	float *in[3], *buf;
+	uint32_t i;
+
+	if (globals.mix_function == NULL)
+		globals.mix_function = mix_find_info(0)->func;
+
+	for (i = 0; i < 3; i++)
+		in[i] = test_alloc(TEST_FRAMES * sizeof(float));
+
+	assert((p = alloc_port(c, SPA_DIRECTION_INPUT, 0, 0)) != NULL);
+	port = (jack_port_t *) p->object;
+	add_input_mix(c, p, 0, &io[0], in[0]);
+	add_input_mix(c, p, 1, &io[1], in[1]);
+	fill(in[0], TEST_FRAMES, 1.0f);
+	fill(in[1], TEST_FRAMES, 2.0f);
+
+	c->cycle = 1;
+	buf = jack_port_get_buffer(port, 256);
+	assert(buf == p->emptyptr);
+	assert(all_equal(buf, 256, 3.0f));
+
+	fill(in[0], TEST_FRAMES, 10.0f);
+	assert(jack_port_get_buffer(port, 256) == buf);
+	assert(jack_port_get_buffer(port, 128) == buf);
+	assert(all_equal(buf, 256, 3.0f));
+
+	assert(jack_port_get_buffer(port, 512) == buf);
+	assert(all_equal(buf, 512, 12.0f));
+
+	c->cycle++;
+	fill(in[1], TEST_FRAMES, 20.0f);
+	assert(jack_port_get_buffer(port, 256) == buf);
+	assert(all_equal(buf, 256, 30.0f));
+
+	/* a new connection in the same cycle */
+	fill(in[2], TEST_FRAMES, 100.0f);
+	add_input_mix(c, p, 2, &io[2], in[2]);
+	assert(jack_port_get_buffer(port, 256) == buf);
+	assert(all_equal(buf, 256, 130.0f));
+
+	/* with one connection the buffer of the peer is used */
+	free_mix(c, find_mix(c, p, 0));
+	free_mix(c, find_mix(c, p, 1));
+	assert(jack_port_get_buffer(port, 256) == in[2]);
+
+	test_client_free(c);
+	for (i = 0; i < 3; i++)
+		free(in[i]);
+}
+
+#define TEST_N_MIX	100
+
+/* ports and connections are allocated in chunks, without a fixed limit */
+static void test_pool_growth(void)
+{
+	struct client *c = test_client_new();
+	struct spa_io_buffers io[TEST_N_MIX];
+	struct port *p, *ports[TEST_N_PORTS];
+	float *in, *buf;
+	uint32_t i;
+
+	if (globals.mix_function == NULL)
+		globals.mix_function = mix_find_info(0)->func;
+
+	for (i = 0; i < TEST_N_PORTS; i++) {
+		assert((ports[i] = alloc_port(c, SPA_DIRECTION_INPUT, 0, 0)) != NULL);
+		assert(GET_PORT(c, SPA_DIRECTION_INPUT, ports[i]->id) == ports[i]);
+	}
+	assert(c->n_ports[SPA_DIRECTION_INPUT] >= TEST_N_PORTS);
+
+	in = test_alloc(TEST_FRAMES * sizeof(float));
+	fill(in, TEST_FRAMES, 1.0f);
+
+	p = ports[TEST_N_PORTS - 1];
+	for (i = 0; i < TEST_N_MIX; i++)
+		add_input_mix(c, p, i, &io[i], in);
+	assert(p->n_mix == TEST_N_MIX);
+	assert(p->max_mix >= TEST_N_MIX);
+	assert(c->n_mix >= TEST_N_MIX);
+
+	c->cycle = 1;
+	buf = jack_port_get_buffer((jack_port_t *) p->object, TEST_FRAMES);
+	assert(all_equal(buf, TEST_FRAMES, (float) TEST_N_MIX));
+
+	test_client_free(c);
+	free(in);
+}
+
+/* a quantum that is larger than the buffers makes the protocol loop
+ * negotiate larger ones */
+static void test_large_quantum(void)
+{
+	struct client *c = test_client_new();
+	struct pw_node_activation *own, *driver;
+	struct spa_io_position *pos;
+	struct port *p;
+	uint32_t frames = 4 * DEFAULT_MAX_BUFFER_FRAMES;
+
+	own = test_alloc(sizeof(struct pw_node_activation));
+	driver = test_alloc(sizeof(struct pw_node_activation));
+	pos = test_alloc(sizeof(struct spa_io_position));
+	c->activation = own;
+	c->driver_activation = driver;
+	c->position = pos;
+	pos->clock.rate.denom = 48000;
+
+	pos->clock.duration = 1024;
+	assert(cycle_run(c) == 1024);
+	on_batch_event(c, 1);
+	assert(c->max_frames == DEFAULT_MAX_BUFFER_FRAMES);
+
+	pos->clock.duration = frames;
+	assert(cycle_run(c) == frames);
+	assert(c->graph_frames == frames);
+	assert(c->max_frames == DEFAULT_MAX_BUFFER_FRAMES);
+	on_batch_event(c, 1);
+	assert(c->max_frames == frames);
+
+	assert((p = alloc_port(c, SPA_DIRECTION_OUTPUT, 0, 0)) != NULL);
+	assert(p->empty_frames >= frames);
+
+	rt_client = NULL;
+	c->activation = c->driver_activation = NULL;
+	c->position = NULL;
+	test_client_free(c);
+	free(pos);
+	free(driver);
+	free(own);
+}
+
+/* a pooled port that changes type never keeps a merge heap that is smaller
+ * than its mix data */
+static void test_mix_cursors(void)
+{
+	struct client *c = test_client_new();
+	struct port *p, *q;
+	struct midi_cursor *cursors;
+	uint32_t i;
+
+	assert((p = alloc_port(c, SPA_DIRECTION_INPUT, 1, 0)) != NULL);
+	assert(ensure_mix_data(c, p, 1) == 0);
+	assert(p->max_mix == MIX_CHUNK);
+	assert((cursors = p->mix_cursors) != NULL);
+
+	/* used as audio and grown */
+	p->object->port.type_id = 0;
+	assert(ensure_mix_data(c, p, MIX_CHUNK + 1) == 0);
+	assert(p->max_mix == 2 * MIX_CHUNK);
+	assert(p->mix_cursors == NULL);
+
+	/* used as MIDI again, the heap is made for the larger size */
+	p->object->port.type_id = 1;
+	assert(ensure_mix_data(c, p, MIX_CHUNK + 1) == 0);
+	assert(p->max_mix == 2 * MIX_CHUNK);
+	assert(p->mix_cursors != NULL && p->mix_cursors != cursors);
+
+	/* the heap is not kept when the port comes back from the pool */
+	free_port(c, p);
+	for (i = 0; i < c->n_ports[SPA_DIRECTION_INPUT]; i++) {
+		assert((q = alloc_port(c, SPA_DIRECTION_INPUT, 1, 0)) != NULL);
+		if (q == p)
+			break;
+	}
+	assert(q == p);
+	assert(p->mix_cursors == NULL);
+	assert(ensure_mix_data(c, p, 1) == 0);
+	assert(p->mix_cursors != NULL);
+
+	test_client_free(c);
+}
+
+/* what client_node_set_activation() does with a mapped activation */
+static void add_peer(struct client *c, uint32_t node_id,
+		struct pw_node_activation *activation, int signalfd)
+{
+	uint32_t idx = link_index(&c->links, node_id);
+	struct link *link;
+
+	assert(pw_array_add(&c->links, sizeof(struct link)) != NULL);
+	link = pw_array_get_unchecked(&c->links, idx, struct link);
+	memmove(link + 1, link, SPA_PTRDIFF(pw_array_end(&c->links), link + 1));
+	link->node_id = node_id;
+	link->mem = NULL;
+	link->activation = activation;
+	link->signalfd = signalfd;
+	assert(update_signals(c) == 0);
+}
+
+static uint64_t read_eventfd(int fd)
+{
+	uint64_t cmd;
+	if (read(fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+		return 0;
+	return cmd;
+}
+
+/* a spinning peer is triggered through its status only, the others get
+ * a write as well, and a late write is not taken for a new cycle */
+static void test_signal(void)
+{
+	struct client *c = test_client_new();
+	struct pw_node_activation *own, *a;
+	struct spa_source source = { 0, };
+	int fd[3];
+	uint32_t i;
+
+	own = test_alloc(sizeof(struct pw_node_activation));
+	a = test_alloc(3 * sizeof(struct pw_node_activation));
+	c->activation = own;
+
+	for (i = 0; i < 3; i++) {
+		assert((fd[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0);
+		a[i].status = PW_NODE_ACTIVATION_NOT_TRIGGERED;
+		a[i].state[0].required = a[i].state[0].pending = 1;
+		add_peer(c, 10 + i, &a[i], fd[i]);
+	}
+	a[0].status |= STATUS_SPINNING;
+	a[2].state[0].required = a[2].state[0].pending = 2;
+
+	signal_sync(c);
+	assert(own->status == PW_NODE_ACTIVATION_FINISHED);
+
+	assert(a[0].status == PW_NODE_ACTIVATION_TRIGGERED);
+	assert(read_eventfd(fd[0]) == 0);
+	assert(a[1].status == PW_NODE_ACTIVATION_TRIGGERED);
+	assert(read_eventfd(fd[1]) == 1);
+	assert(a[2].status == PW_NODE_ACTIVATION_NOT_TRIGGERED);
+	assert(a[2].state[0].pending == 1);
+	assert(read_eventfd(fd[2]) == 0);
+
+	/* we were triggered and then written to */
+	source.fd = fd[0];
+	c->socket_source = &source;
+	own->status = PW_NODE_ACTIVATION_TRIGGERED;
+	assert(write(fd[0], &(uint64_t) { 1 }, sizeof(uint64_t)) == sizeof(uint64_t));
+	assert(cycle_wakeup(c));
+	/* nothing written */
+	assert(!cycle_wakeup(c));
+
+	/* without spinning, a write always runs a cycle, also when it was
+	 * retriggered while our late signal_sync() finished the status */
+	own->status = PW_NODE_ACTIVATION_FINISHED;
+	assert(write(fd[0], &(uint64_t) { 1 }, sizeof(uint64_t)) == sizeof(uint64_t));
+	assert(cycle_wakeup(c));
+
+	/* when spinning, the write is for a cycle that we already ran */
+	c->spin_nsec = 10000;
+	assert(write(fd[0], &(uint64_t) { 1 }, sizeof(uint64_t)) == sizeof(uint64_t));
+	assert(!cycle_wakeup(c));
+	own->status = PW_NODE_ACTIVATION_TRIGGERED;
+	assert(write(fd[0], &(uint64_t) { 1 }, sizeof(uint64_t)) == sizeof(uint64_t));
+	assert(cycle_wakeup(c));
+	c->spin_nsec = 0;
+	c->socket_source = NULL;
+
+	c->activation = NULL;
+	test_client_free(c);
+	for (i = 0; i < 3; i++)
+		close(fd[i]);
+	free(a);
+	free(own);
+}
+
+static void check_signals(struct client *c)
+{
+	struct signal_table *t = c->signals;
+	struct link *l;
+	uint32_t i = 0;
+
+	assert(t != NULL);
+	assert(t->n_links == pw_array_get_len(&c->links, struct link));
+	pw_array_for_each(l, &c->links) {
+		assert(t->node_id[i] == l->node_id);
+		assert(t->activation[i] == l->activation);
+		assert(t->state[i] == &l->activation->state[0]);
+		assert(t->signalfd[i] == l->signalfd);
+		if (i > 0)
+			assert(t->node_id[i - 1] < t->node_id[i]);
+		i++;
+	}
+}
+
+#define TEST_N_PEERS	50
+
+/* the table in the data loop follows the links as they come and go */
+static void test_signal_table(void)
+{
+	struct client *c = test_client_new();
+	struct pw_node_activation *a;
+	struct link *l;
+	uint32_t i, id;
+
+	a = test_alloc(TEST_N_PEERS * sizeof(struct pw_node_activation));
+
+	for (i = 0; i < TEST_N_PEERS; i++) {
+		id = (i * 7) % TEST_N_PEERS;
+		add_peer(c, id, &a[id], 100 + id);
+		check_signals(c);
+	}
+	assert(c->signals->n_links == TEST_N_PEERS);
+
+	for (i = 0; i < TEST_N_PEERS; i += 3) {
+		assert((l = find_activation(&c->links, i)) != NULL);
+		remove_activation(&c->links, l);
+		assert(find_activation(&c->links, i) == NULL);
+		assert(update_signals(c) == 0);
+		check_signals(c);
+	}
+	assert(c->signals->n_links == TEST_N_PEERS - (TEST_N_PEERS + 2) / 3);
+
+	pw_array_reset(&c->links);
+	assert(update_signals(c) == 0);
+	assert(c->signals->n_links == 0);
+
+	test_client_free(c);
+	free(a);
+}
+
+/* MIDI buffers follow the quantum of the client or the graph, unless
+ * configured, and are at least as large as the hint of the port */
+static void test_midi_buffer_size(void)
+{
+	struct client *c = test_client_new();
+	struct port *p;
+
+	c->quantum = 256;
+	assert(midi_buffer_size(c, 0) == MIN_MIDI_BUFFER_SIZE);
+	c->quantum = 4096;
+	assert(midi_buffer_size(c, 0) == 4096 * sizeof(float));
+	assert(midi_buffer_size(c, 1000) == 4096 * sizeof(float));
+	assert(midi_buffer_size(c, 64 * 1024) == 64 * 1024);
+	assert(jack_port_type_get_buffer_size((jack_client_t *) c,
+				JACK_DEFAULT_MIDI_TYPE) == 4096 * sizeof(float));
+
+	/* the graph runs with a larger quantum than we asked for */
+	c->graph_frames = 8192;
+	on_batch_event(c, 1);
+	assert(midi_buffer_size(c, 0) == 8192 * sizeof(float));
+
+	c->midi_buffer_size = 32 * 1024;
+	assert(midi_buffer_size(c, 0) == 32 * 1024);
+	assert(midi_buffer_size(c, 64 * 1024) == 64 * 1024);
+	c->midi_buffer_size = 1024;
+	assert(midi_buffer_size(c, 0) == MIN_MIDI_BUFFER_SIZE);
+
+	/* a hint of 8192 frames as given to jack_port_register() */
+	assert((p = alloc_port(c, SPA_DIRECTION_OUTPUT, 1, 8192 * sizeof(float))) != NULL);
+	assert(p->midi_size == 8192 * sizeof(float));
+	assert(p->empty_frames * sizeof(float) >= p->midi_size);
+
+	/* audio ports don't use the hint */
+	assert((p = alloc_port(c, SPA_DIRECTION_OUTPUT, 0, 0)) != NULL);
+	assert(p->midi_size == 0);
+	assert(p->empty_frames >= c->max_frames);
+
+	test_client_free(c);
+}
+
+static void test_rt_log(void)
+{
+	struct client *c = test_client_new();
+	struct rt_log *log = &c->rt_log;
+
+	/* only the first record wakes up the notify thread */
+	rt_log(c, RT_LOG_MIDI_SIZE, c, 0, 1, 0);
+	rt_log(c, RT_LOG_MIDI_SIZE, c, 0, 2, 0);
+	assert(c->rt_log_event->rmask == 1);
+	assert(c->rt_log_timer->rmask == 0);
+
+	/* which arms the timer once */
+	on_rt_log_event(c, 1);
+	on_rt_log_event(c, 1);
+	assert(log->armed);
+	assert(c->rt_log_timer->rmask == 1);
+
+	/* the second message is counted, the timer comes back for it */
+	on_rt_log_timeout(c, 1);
+	assert(log->suppressed[RT_LOG_MIDI_SIZE] == 1);
+	assert(!log->pending);
+	assert(log->armed);
+	assert(c->rt_log_timer->rmask == 2);
+
+	/* the count is logged when the period ends, nothing else to wait for */
+	log->last_time[RT_LOG_MIDI_SIZE] -= RT_LOG_RATE_NSEC;
+	on_rt_log_timeout(c, 1);
+	assert(log->suppressed[RT_LOG_MIDI_SIZE] == 0);
+	assert(!log->armed);
+	assert(c->rt_log_timer->rmask == 2);
+
+	/* a full ring only counts, it still wakes up the notify thread */
+	rt_log(c, RT_LOG_READ_FAILED, c, EIO, 0, 0);
+	assert(c->rt_log_event->rmask == 2);
+	while (log->dropped == 0)
+		rt_log(c, RT_LOG_READ_FAILED, c, EIO, 0, 0);
+	assert(c->rt_log_event->rmask == 2);
+	assert(rt_log_flush(c, true) == 0);
+	assert(log->dropped == 0);
+	assert(log->suppressed[RT_LOG_READ_FAILED] == 0);
+
+	test_client_free(c);
+}
+
+int main(int argc, char *argv[])
+{
+	test_midi_merge();
+	test_midi_view();
+	test_midi_encode();
+	test_port_names();
+	test_links();
+	test_graph();
+	test_removed_port();
+	test_get_ports();
+	test_mix_functions();
+	test_buffer_cache();
+	test_pool_growth();
+	test_large_quantum();
+	test_mix_cursors();
+	test_signal();
+	test_signal_table();
+	test_midi_buffer_size();
+	test_rt_log();
+
+	return 0;
+}